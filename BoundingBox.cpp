@@ -0,0 +1,47 @@
+//
+// Created by remi on 18/10/26.
+//
+
+#include "BoundingBox.h"
+
+#include <algorithm>
+
+Vector BoundingBox::extent() const {
+	return max - min;
+}
+
+Vector BoundingBox::center() const {
+	return (min + max) / 2;
+}
+
+double BoundingBox::surfaceArea() const {
+	Vector size = extent();
+	return 2 * (size[0] * size[1] + size[1] * size[2] + size[2] * size[0]);
+}
+
+bool BoundingBox::empty() const {
+	return min[0] > max[0] || min[1] > max[1] || min[2] > max[2];
+}
+
+BoundingBox BoundingBox::intersection(const BoundingBox& box) const {
+	BoundingBox result;
+	for (uint32_t i = 0; i < 3; i++) {
+		result.min[i] = std::max(min[i], box.min[i]);
+		result.max[i] = std::min(max[i], box.max[i]);
+	}
+	return result;
+}
+
+void BoundingBox::grow(const Vector& point) {
+	for (uint32_t i = 0; i < 3; i++) {
+		min[i] = std::min(min[i], point[i]);
+		max[i] = std::max(max[i], point[i]);
+	}
+}
+
+void BoundingBox::grow(const BoundingBox& box) {
+	for (uint32_t i = 0; i < 3; i++) {
+		min[i] = std::min(min[i], box.min[i]);
+		max[i] = std::max(max[i], box.max[i]);
+	}
+}
@@ -0,0 +1,26 @@
+//
+// Created by remi on 18/10/26.
+//
+
+#ifndef BOUNDINGBOX_H
+#define BOUNDINGBOX_H
+
+#include <limits>
+
+#include "Vector.h"
+
+class BoundingBox {
+public:
+	[[nodiscard]] Vector extent() const;
+	[[nodiscard]] Vector center() const;
+	[[nodiscard]] double surfaceArea() const;
+	[[nodiscard]] bool empty() const;
+	[[nodiscard]] BoundingBox intersection(const BoundingBox& box) const;
+	void grow(const Vector& point);
+	void grow(const BoundingBox& box);
+
+	Vector min = Vector(std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity());
+	Vector max = Vector(-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity());
+};
+
+#endif //BOUNDINGBOX_H
@@ -0,0 +1,688 @@
+//
+// Created by remi on 18/10/26.
+//
+
+#include "BoundingVolumeHierarchy.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+
+#include "RayPacket.h"
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+constexpr uint32_t PARALLEL_BUILD_THRESHOLD = 1 << 14;
+constexpr uint32_t PARALLEL_CHUNK_SIZE = 1 << 12;
+// Spatial splits are only tried when the children of the best object split overlap by more than this fraction of the root area
+constexpr double SPATIAL_SPLIT_OVERLAP_THRESHOLD = 1e-5;
+
+struct BoundingVolumeHierarchy::SpatialReference {
+	uint32_t primitive;
+	BoundingBox bounds; // part of the primitive referenced, clipped by the spatial splits above
+};
+
+struct BoundingVolumeHierarchy::SpatialBuildState {
+	const BvhBuildOptions& options;
+	const PrimitiveClipper& clipper;
+	double minOverlapArea;
+	uint32_t remainingReferences;
+};
+
+// Bin of a SAH sweep. entries and exits count the primitives whose first and last bin this is,
+// both are the number of centroids in the bin for object splits.
+struct SahBin {
+	BoundingBox bounds;
+	uint32_t entries = 0;
+	uint32_t exits = 0;
+};
+
+typedef std::array<SahBin, MAX_SAH_BIN_COUNT> SahBins;
+
+struct SahSplit {
+	double cost = std::numeric_limits<double>::infinity();
+	uint32_t axis = 0;
+	uint32_t bin = 0; // last bin on the left side
+};
+
+// Keeps in best the plane between two of the first binCount bins minimizing countLeft * areaLeft + countRight * areaRight
+static void sweepSahBins(const SahBins& bins, uint32_t binCount, uint32_t axis, SahSplit& best) {
+	std::array<double, MAX_SAH_BIN_COUNT - 1> leftCosts {};
+	std::array<uint32_t, MAX_SAH_BIN_COUNT - 1> leftCounts {};
+	BoundingBox left;
+	uint32_t leftCount = 0;
+	for (uint32_t bin = 0; bin < binCount - 1; bin++) {
+		if (!bins[bin].bounds.empty()) { left.grow(bins[bin].bounds); }
+		leftCount += bins[bin].entries;
+		leftCounts[bin] = leftCount;
+		leftCosts[bin] = leftCount * left.surfaceArea();
+	}
+	BoundingBox right;
+	uint32_t rightCount = 0;
+	for (uint32_t bin = binCount - 1; bin > 0; bin--) {
+		if (!bins[bin].bounds.empty()) { right.grow(bins[bin].bounds); }
+		rightCount += bins[bin].exits;
+		if (leftCounts[bin - 1] == 0 || rightCount == 0) { continue; }
+		double cost = leftCosts[bin - 1] + rightCount * right.surfaceArea();
+		if (cost < best.cost) { best = {.cost = cost, .axis = axis, .bin = bin - 1}; }
+	}
+}
+
+// Compares testing count primitives with the split found by sweepSahBins
+static bool isLeafCheaper(const SahSplit& split, uint32_t count, const BoundingBox& bounds, const BvhBuildOptions& options) {
+	double area = bounds.surfaceArea();
+	return options.intersectionCost * count * area <= options.traversalCost * area + options.intersectionCost * split.cost;
+}
+
+static float roundDown(double x) {
+	auto rounded = static_cast<float>(x);
+	return rounded > x ? std::nextafter(rounded, -std::numeric_limits<float>::infinity()) : rounded;
+}
+
+static float roundUp(double x) {
+	auto rounded = static_cast<float>(x);
+	return rounded < x ? std::nextafter(rounded, std::numeric_limits<float>::infinity()) : rounded;
+}
+
+void BvhNode::setBounds(const BoundingBox& box) {
+	for (uint32_t i = 0; i < 3; i++) {
+		min[i] = roundDown(box.min[i]);
+		max[i] = roundUp(box.max[i]);
+	}
+}
+
+BoundingBox BvhNode::bounds() const {
+	return {.min = Vector(min[0], min[1], min[2]), .max = Vector(max[0], max[1], max[2])};
+}
+
+bool BvhNode::isLeaf() const {
+	return primitiveCount != 0;
+}
+
+BvhNode::IntersectResult BvhNode::intersect(const Ray& ray) const {
+	double maxOfMin = -std::numeric_limits<double>::infinity();
+	double minOfMax = std::numeric_limits<double>::infinity();
+	for (uint32_t i = 0; i < 3; i++) {
+		double inter1 = (min[i] - ray.origin[i]) / ray.direction[i];
+		double inter2 = (max[i] - ray.origin[i]) / ray.direction[i];
+		maxOfMin = std::max(maxOfMin, std::min(inter1, inter2));
+		minOfMax = std::min(minOfMax, std::max(inter1, inter2));
+	}
+	return {maxOfMin, minOfMax > 0 && minOfMax >= maxOfMin};
+}
+
+// Four lanes at a time, with the near and far planes of each lane picked by min and max since their directions differ.
+// NaN distances (ray origin on a plane it is parallel to) are ignored by keeping the accumulator as second operand
+// of the SSE instructions, which return it on NaN, and as first operand of std::min and std::max, which return it instead.
+#if defined(__SSE__)
+uint32_t BvhNode::intersect(const RayPacket& packet, uint32_t mask, float& nearest) const {
+	uint32_t hits = 0;
+	nearest = std::numeric_limits<float>::infinity();
+	for (uint32_t lane = 0; lane < packet.size; lane += 4) {
+		if ((mask >> lane & 0xf) == 0) { continue; }
+		__m128 tNear = _mm_setzero_ps();
+		__m128 tFar = _mm_load_ps(packet.tMax.data() + lane);
+		for (uint32_t axis = 0; axis < 3; axis++) {
+			__m128 origin = _mm_load_ps(packet.origin[axis].data() + lane);
+			__m128 inverseDirection = _mm_load_ps(packet.inverseDirection[axis].data() + lane);
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(min[axis]), origin), inverseDirection);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(max[axis]), origin), inverseDirection);
+			tNear = _mm_max_ps(_mm_min_ps(t0, t1), tNear);
+			tFar = _mm_min_ps(_mm_mul_ps(_mm_max_ps(t0, t1), _mm_set1_ps(SLAB_PADDING)), tFar);
+		}
+		uint32_t laneHits = static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(tNear, tFar))) & mask >> lane & 0xf;
+		if (laneHits == 0) { continue; }
+		std::array<float, 4> distances {};
+		_mm_storeu_ps(distances.data(), tNear);
+		for (uint32_t bits = laneHits; bits != 0; bits &= bits - 1) { nearest = std::min(nearest, distances[static_cast<uint32_t>(std::countr_zero(bits))]); }
+		hits |= laneHits << lane;
+	}
+	return hits;
+}
+#else
+uint32_t BvhNode::intersect(const RayPacket& packet, uint32_t mask, float& nearest) const {
+	uint32_t hits = 0;
+	nearest = std::numeric_limits<float>::infinity();
+	for (uint32_t lane = 0; lane < packet.size; lane++) {
+		if ((mask >> lane & 1) == 0) { continue; }
+		float tNear = 0;
+		float tFar = packet.tMax[lane];
+		for (uint32_t axis = 0; axis < 3; axis++) {
+			float t0 = (min[axis] - packet.origin[axis][lane]) * packet.inverseDirection[axis][lane];
+			float t1 = (max[axis] - packet.origin[axis][lane]) * packet.inverseDirection[axis][lane];
+			tNear = std::max(tNear, std::min(t1, t0));
+			tFar = std::min(tFar, std::max(t1, t0) * SLAB_PADDING);
+		}
+		if (tNear <= tFar) {
+			hits |= 1u << lane;
+			nearest = std::min(nearest, tNear);
+		}
+	}
+	return hits;
+}
+#endif
+
+// Spreads the 21 low bits of x so that two zero bits separate each of them
+static uint64_t expandBits(uint64_t x) {
+	x &= 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffff;
+	x = (x | x << 16) & 0x1f0000ff0000ff;
+	x = (x | x << 8) & 0x100f00f00f00f00f;
+	x = (x | x << 4) & 0x10c30c30c30c30c3;
+	x = (x | x << 2) & 0x1249249249249249;
+	return x;
+}
+
+uint64_t mortonCode(const Vector& point, const BoundingBox& bounds) {
+	Vector extent = bounds.extent();
+	uint64_t code = 0;
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		double position = extent[axis] > 0 ? (point[axis] - bounds.min[axis]) / extent[axis] : 0;
+		code |= expandBits(static_cast<uint64_t>(position * ((1 << 21) - 1))) << (2 - axis);
+	}
+	return code;
+}
+
+void radixSort(std::vector<uint64_t>& codes, std::vector<uint32_t>& order, uint32_t keyBits) {
+	constexpr uint32_t DIGIT_BITS = 8;
+	constexpr uint32_t DIGIT_COUNT = 1 << DIGIT_BITS;
+	auto size = static_cast<uint32_t>(order.size());
+	uint32_t chunkCount = (size + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+	std::vector<uint64_t> sortedCodes(size);
+	std::vector<uint32_t> sortedOrder(size);
+	std::vector<std::array<uint32_t, DIGIT_COUNT>> offsets(chunkCount);
+	for (uint32_t shift = 0; shift < keyBits; shift += DIGIT_BITS) {
+#pragma omp parallel for default(none) shared(codes, offsets, chunkCount, size, shift)
+		for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+			offsets[chunk].fill(0);
+			for (uint32_t index = chunk * PARALLEL_CHUNK_SIZE; index < std::min(size, (chunk + 1) * PARALLEL_CHUNK_SIZE); index++) {
+				offsets[chunk][codes[index] >> shift & (DIGIT_COUNT - 1)]++;
+			}
+		}
+		uint32_t offset = 0;
+		for (uint32_t digit = 0; digit < DIGIT_COUNT; digit++) {
+			for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+				uint32_t count = offsets[chunk][digit];
+				offsets[chunk][digit] = offset;
+				offset += count;
+			}
+		}
+#pragma omp parallel for default(none) shared(codes, order, sortedCodes, sortedOrder, offsets, chunkCount, size, shift)
+		for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+			for (uint32_t index = chunk * PARALLEL_CHUNK_SIZE; index < std::min(size, (chunk + 1) * PARALLEL_CHUNK_SIZE); index++) {
+				uint32_t destination = offsets[chunk][codes[index] >> shift & (DIGIT_COUNT - 1)]++;
+				sortedCodes[destination] = codes[index];
+				sortedOrder[destination] = order[index];
+			}
+		}
+		codes.swap(sortedCodes);
+		order.swap(sortedOrder);
+	}
+}
+
+// Sorts order by the Morton code of the centroids and returns the sorted codes
+static std::vector<uint64_t> sortByMortonCode(std::vector<uint32_t>& order, const std::vector<Vector>& centroids) {
+	auto size = static_cast<uint32_t>(order.size());
+	BoundingBox centroidBounds;
+	for (const Vector& centroid: centroids) { centroidBounds.grow(centroid); }
+	std::vector<uint64_t> codes(size);
+#pragma omp parallel for default(none) shared(codes, centroids, centroidBounds, size)
+	for (uint32_t index = 0; index < size; index++) { codes[index] = mortonCode(centroids[index], centroidBounds); }
+	radixSort(codes, order);
+	return codes;
+}
+
+std::vector<uint32_t> BoundingVolumeHierarchy::build(const std::vector<BoundingBox>& primitiveBounds, const std::vector<Vector>& centroids, const BvhBuildOptions& options,
+                                                     const PrimitiveClipper& clipper) {
+	if (options.maxLeafSize == 0) { throw std::runtime_error("BVH leaves must hold at least one primitive"); }
+	if (options.binCount < 2 || options.binCount > MAX_SAH_BIN_COUNT) { throw std::runtime_error(std::format("BVH bin count must be between 2 and {}", MAX_SAH_BIN_COUNT)); }
+	std::vector<uint32_t> order(primitiveBounds.size());
+	std::iota(order.begin(), order.end(), 0);
+	nodes.clear();
+	if (order.empty()) { return order; }
+	std::vector<BvhNode> builtNodes;
+	builtNodes.reserve(2 * order.size());
+	BuildInput input {primitiveBounds, centroids, options};
+	if (options.builder == BvhBuilder::SpatialSah && clipper) {
+		std::vector<SpatialReference> references(order.size());
+		for (uint32_t index = 0; index < order.size(); index++) { references[index] = {.primitive = index, .bounds = primitiveBounds[index]}; }
+		BoundingBox rootBounds;
+		for (const BoundingBox& bounds: primitiveBounds) { rootBounds.grow(bounds); }
+		SpatialBuildState state {options, clipper, SPATIAL_SPLIT_OVERLAP_THRESHOLD * rootBounds.surfaceArea(), static_cast<uint32_t>(order.size() * options.spatialSplitBudget)};
+		order.clear();
+		buildSpatialNode(builtNodes, order, references, 0, state);
+	} else if (options.builder == BvhBuilder::Morton) {
+		std::vector<uint64_t> codes = sortByMortonCode(order, centroids);
+#pragma omp parallel default(none) shared(builtNodes, codes, order, input)
+#pragma omp single
+		buildMortonNode(builtNodes, codes, order, 0, order.size(), 0, input);
+	} else {
+#pragma omp parallel default(none) shared(builtNodes, order, input)
+#pragma omp single
+		buildNode(builtNodes, order, 0, order.size(), 0, input);
+	}
+	nodes = std::move(builtNodes);
+	nodes.shrink_to_fit();
+	builtSahCost = sahCost();
+	return order;
+}
+
+void BoundingVolumeHierarchy::refit(const std::vector<BoundingBox>& primitiveBounds) {
+	if (nodes.empty()) { return; }
+#pragma omp parallel default(none) shared(primitiveBounds)
+#pragma omp single
+	refitNode(0, primitiveBounds);
+}
+
+BoundingBox BoundingVolumeHierarchy::refitNode(uint32_t nodeIndex, const std::vector<BoundingBox>& primitiveBounds) {
+	BvhNode& node = nodes[nodeIndex];
+	BoundingBox bounds;
+	if (node.isLeaf()) {
+		for (uint32_t index = node.offset; index < node.offset + node.primitiveCount; index++) { bounds.grow(primitiveBounds[index]); }
+	} else if (node.offset - nodeIndex < PARALLEL_BUILD_THRESHOLD) {
+		bounds = refitNode(nodeIndex + 1, primitiveBounds);
+		bounds.grow(refitNode(node.offset, primitiveBounds));
+	} else {
+		BoundingBox rightBounds;
+		uint32_t rightChild = node.offset;
+#pragma omp task default(none) shared(bounds, primitiveBounds) firstprivate(nodeIndex)
+		bounds = refitNode(nodeIndex + 1, primitiveBounds);
+#pragma omp task default(none) shared(rightBounds, primitiveBounds) firstprivate(rightChild)
+		rightBounds = refitNode(rightChild, primitiveBounds);
+#pragma omp taskwait
+		bounds.grow(rightBounds);
+	}
+	node.setBounds(bounds);
+	return bounds;
+}
+
+// Children always come after their parent, so one pass in memory order sees each parent before its children
+bool BoundingVolumeHierarchy::valid(size_t primitiveCount) const {
+	constexpr uint32_t UNREACHED = std::numeric_limits<uint32_t>::max();
+	std::vector<uint32_t> depths(nodes.size(), UNREACHED);
+	if (!nodes.empty()) { depths[0] = 0; }
+	for (uint32_t index = 0; index < nodes.size(); index++) {
+		const BvhNode& node = nodes[index];
+		if (depths[index] == UNREACHED) { return false; }
+		if (node.isLeaf()) {
+			if (node.offset + static_cast<uint64_t>(node.primitiveCount) > primitiveCount) { return false; }
+			continue;
+		}
+		if (depths[index] >= MAX_BVH_DEPTH || node.offset <= index + 1 || node.offset >= nodes.size()) { return false; }
+		if (depths[index + 1] != UNREACHED || depths[node.offset] != UNREACHED) { return false; }
+		depths[index + 1] = depths[index] + 1;
+		depths[node.offset] = depths[index] + 1;
+	}
+	return true;
+}
+
+double BoundingVolumeHierarchy::sahCost() const {
+	if (nodes.empty()) { return 0; }
+	double cost = 0;
+	for (const BvhNode& node: nodes) { cost += node.bounds().surfaceArea() * (node.isLeaf() ? node.primitiveCount : 1); }
+	return cost / nodes[0].bounds().surfaceArea();
+}
+
+BvhStatistics BoundingVolumeHierarchy::statistics() const {
+	BvhStatistics statistics;
+	if (nodes.empty()) { return statistics; }
+	statistics.nodeCount = nodes.size();
+	statistics.sahCost = sahCost();
+	struct Entry {
+		uint32_t node;
+		uint32_t depth;
+	};
+	TraversalStack<Entry, MAX_BVH_DEPTH + 1> stack;
+	stack.push({0, 0});
+	uint64_t leafDepthSum = 0;
+	double overlapSum = 0;
+	while (!stack.empty()) {
+		auto [nodeIndex, depth] = stack.pop();
+		const BvhNode& node = nodes[nodeIndex];
+		statistics.maxDepth = std::max(statistics.maxDepth, depth);
+		if (node.isLeaf()) {
+			statistics.leafCount++;
+			leafDepthSum += depth;
+			if (statistics.leafSizes.size() <= node.primitiveCount) { statistics.leafSizes.resize(node.primitiveCount + 1); }
+			statistics.leafSizes[node.primitiveCount]++;
+			continue;
+		}
+		BoundingBox overlap = nodes[nodeIndex + 1].bounds().intersection(nodes[node.offset].bounds());
+		double area = node.bounds().surfaceArea();
+		if (!overlap.empty() && area > 0) { overlapSum += overlap.surfaceArea() / area; }
+		stack.push({node.offset, depth + 1});
+		stack.push({nodeIndex + 1, depth + 1});
+	}
+	statistics.averageLeafDepth = static_cast<double>(leafDepthSum) / statistics.leafCount;
+	if (statistics.nodeCount > statistics.leafCount) { statistics.siblingOverlap = overlapSum / (statistics.nodeCount - statistics.leafCount); }
+	return statistics;
+}
+
+size_t BoundingVolumeHierarchy::byteSize() const {
+	return nodes.size() * sizeof(BvhNode);
+}
+
+// Ranges of at least PARALLEL_BUILD_THRESHOLD primitives are processed in chunks of fixed size, as OpenMP tasks.
+// Chunk results are merged in chunk order, so the tree does not depend on the number of threads.
+template<typename T, typename Map, typename Reduce>
+static T reduceChunks(uint32_t start, uint32_t end, Map&& map, Reduce&& reduce) {
+	if (end - start < PARALLEL_BUILD_THRESHOLD) { return map(start, end); }
+	uint32_t chunkCount = (end - start + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+	std::vector<T> partials(chunkCount);
+#pragma omp taskloop default(shared) grainsize(1)
+	for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+		partials[chunk] = map(start + chunk * PARALLEL_CHUNK_SIZE, std::min(end, start + (chunk + 1) * PARALLEL_CHUNK_SIZE));
+	}
+	for (uint32_t chunk = 1; chunk < chunkCount; chunk++) { reduce(partials[0], partials[chunk]); }
+	return partials[0];
+}
+
+// Large ranges use a stable partition (count, prefix sum, scatter) which gives the same result for any number of threads.
+template<typename Predicate>
+static uint32_t partitionRange(std::vector<uint32_t>& order, uint32_t start, uint32_t end, Predicate&& predicate) {
+	if (end - start < PARALLEL_BUILD_THRESHOLD) {
+		return std::distance(order.begin(), std::partition(order.begin() + start, order.begin() + end, predicate));
+	}
+	uint32_t chunkCount = (end - start + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+	std::vector<uint32_t> source(order.begin() + start, order.begin() + end);
+	std::vector<uint32_t> leftCounts(chunkCount);
+#pragma omp taskloop default(shared) grainsize(1)
+	for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+		auto chunkStart = source.begin() + chunk * PARALLEL_CHUNK_SIZE;
+		auto chunkEnd = source.begin() + std::min(end - start, (chunk + 1) * PARALLEL_CHUNK_SIZE);
+		leftCounts[chunk] = std::count_if(chunkStart, chunkEnd, predicate);
+	}
+	std::vector<uint32_t> leftOffsets(chunkCount);
+	std::exclusive_scan(leftCounts.begin(), leftCounts.end(), leftOffsets.begin(), start);
+	uint32_t pivot = leftOffsets.back() + leftCounts.back();
+#pragma omp taskloop default(shared) grainsize(1)
+	for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+		uint32_t chunkStart = chunk * PARALLEL_CHUNK_SIZE;
+		uint32_t chunkEnd = std::min(end - start, (chunk + 1) * PARALLEL_CHUNK_SIZE);
+		uint32_t left = leftOffsets[chunk];
+		uint32_t right = pivot + chunkStart - (leftOffsets[chunk] - start);
+		for (uint32_t index = chunkStart; index < chunkEnd; index++) {
+			order[predicate(source[index]) ? left++ : right++] = source[index];
+		}
+	}
+	return pivot;
+}
+
+// Appends a subtree built on its own, shifting the child indices of its interior nodes.
+static void appendSubtree(std::vector<BvhNode>& tree, const std::vector<BvhNode>& subtree) {
+	auto base = static_cast<uint32_t>(tree.size());
+	for (BvhNode node: subtree) {
+		if (!node.isLeaf()) { node.offset += base; }
+		tree.push_back(node);
+	}
+}
+
+uint32_t BoundingVolumeHierarchy::buildNode(std::vector<BvhNode>& tree, std::vector<uint32_t>& order, uint32_t start, uint32_t end, uint32_t depth, const BuildInput& input) {
+	auto nodeIndex = static_cast<uint32_t>(tree.size());
+	tree.emplace_back();
+	BoundingBox bounds = reduceChunks<BoundingBox>(start, end, [&order, &input](uint32_t chunkStart, uint32_t chunkEnd) {
+		BoundingBox chunkBounds;
+		for (uint32_t index = chunkStart; index < chunkEnd; index++) { chunkBounds.grow(input.primitiveBounds[order[index]]); }
+		return chunkBounds;
+	}, [](BoundingBox& result, const BoundingBox& chunkBounds) { result.grow(chunkBounds); });
+	tree[nodeIndex].setBounds(bounds);
+	uint32_t pivot = start;
+	if (depth + 1 < MAX_BVH_DEPTH && input.options.builder == BvhBuilder::Midpoint) {
+		if (end - start > input.options.maxLeafSize) { pivot = splitMidpoint(order, start, end, bounds, input); }
+	} else if (depth + 1 < MAX_BVH_DEPTH && end - start > 1) {
+		pivot = splitBinnedSah(order, start, end, bounds, input);
+	}
+	if (pivot == start || pivot == end) {
+		tree[nodeIndex].offset = start;
+		tree[nodeIndex].primitiveCount = end - start;
+		return nodeIndex;
+	}
+	if (end - start < PARALLEL_BUILD_THRESHOLD) {
+		buildNode(tree, order, start, pivot, depth + 1, input);
+		tree[nodeIndex].offset = buildNode(tree, order, pivot, end, depth + 1, input);
+		return nodeIndex;
+	}
+	std::vector<BvhNode> left;
+	std::vector<BvhNode> right;
+#pragma omp task default(none) shared(left, order, input) firstprivate(start, pivot, depth)
+	buildNode(left, order, start, pivot, depth + 1, input);
+#pragma omp task default(none) shared(right, order, input) firstprivate(pivot, end, depth)
+	buildNode(right, order, pivot, end, depth + 1, input);
+#pragma omp taskwait
+	appendSubtree(tree, left);
+	tree[nodeIndex].offset = tree.size();
+	appendSubtree(tree, right);
+	return nodeIndex;
+}
+
+uint32_t BoundingVolumeHierarchy::splitMidpoint(std::vector<uint32_t>& order, uint32_t start, uint32_t end, const BoundingBox& bounds, const BuildInput& input) {
+	std::array<double, 3> extent = bounds.extent().getCoordinates();
+	auto longestDirection = static_cast<uint32_t>(std::distance(extent.begin(), std::ranges::max_element(extent)));
+	double limit = (bounds.max[longestDirection] + bounds.min[longestDirection]) / 2;
+	return partitionRange(order, start, end, [&input, longestDirection, limit](uint32_t primitive) { return input.centroids[primitive][longestDirection] <= limit; });
+}
+
+// Bins the centroids along each axis and keeps the plane minimizing the SAH.
+// Returns start when every centroid is the same, or when a small enough range is cheaper as a leaf.
+uint32_t BoundingVolumeHierarchy::splitBinnedSah(std::vector<uint32_t>& order, uint32_t start, uint32_t end, const BoundingBox& bounds, const BuildInput& input) {
+	typedef std::array<SahBins, 3> Bins;
+	BoundingBox centroidBounds = reduceChunks<BoundingBox>(start, end, [&order, &input](uint32_t chunkStart, uint32_t chunkEnd) {
+		BoundingBox chunkBounds;
+		for (uint32_t index = chunkStart; index < chunkEnd; index++) { chunkBounds.grow(input.centroids[order[index]]); }
+		return chunkBounds;
+	}, [](BoundingBox& result, const BoundingBox& chunkBounds) { result.grow(chunkBounds); });
+	Vector centroidExtent = centroidBounds.extent();
+	uint32_t binCount = input.options.binCount;
+	auto binOf = [&centroidBounds, &centroidExtent, binCount](const Vector& centroid, uint32_t axis) {
+		auto bin = static_cast<uint32_t>((centroid[axis] - centroidBounds.min[axis]) / centroidExtent[axis] * binCount);
+		return std::min(bin, binCount - 1);
+	};
+	Bins bins = reduceChunks<Bins>(start, end, [&order, &input, &centroidExtent, &binOf](uint32_t chunkStart, uint32_t chunkEnd) {
+		Bins chunkBins;
+		for (uint32_t axis = 0; axis < 3; axis++) {
+			if (centroidExtent[axis] <= 0) { continue; }
+			for (uint32_t index = chunkStart; index < chunkEnd; index++) {
+				SahBin& bin = chunkBins[axis][binOf(input.centroids[order[index]], axis)];
+				bin.entries++;
+				bin.exits++;
+				bin.bounds.grow(input.primitiveBounds[order[index]]);
+			}
+		}
+		return chunkBins;
+	}, [binCount](Bins& result, const Bins& chunkBins) {
+		for (uint32_t axis = 0; axis < 3; axis++) {
+			for (uint32_t bin = 0; bin < binCount; bin++) {
+				result[axis][bin].bounds.grow(chunkBins[axis][bin].bounds);
+				result[axis][bin].entries += chunkBins[axis][bin].entries;
+				result[axis][bin].exits += chunkBins[axis][bin].exits;
+			}
+		}
+	});
+	SahSplit best;
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		if (centroidExtent[axis] > 0) { sweepSahBins(bins[axis], binCount, axis, best); }
+	}
+	if (best.cost == std::numeric_limits<double>::infinity()) { return start; }
+	if (end - start <= input.options.maxLeafSize && isLeafCheaper(best, end - start, bounds, input.options)) { return start; }
+	return partitionRange(order, start, end, [&input, &binOf, &best](uint32_t primitive) { return binOf(input.centroids[primitive], best.axis) <= best.bin; });
+}
+
+// Built serially: spatial splits trade build time for fewer overlapping nodes around long thin primitives.
+uint32_t BoundingVolumeHierarchy::buildSpatialNode(std::vector<BvhNode>& tree, std::vector<uint32_t>& order, std::vector<SpatialReference>& references, uint32_t depth, SpatialBuildState& state) {
+	auto nodeIndex = static_cast<uint32_t>(tree.size());
+	tree.emplace_back();
+	BoundingBox bounds;
+	for (const SpatialReference& reference: references) { bounds.grow(reference.bounds); }
+	tree[nodeIndex].setBounds(bounds);
+	std::vector<SpatialReference> left;
+	std::vector<SpatialReference> right;
+	if (references.size() > 1 && depth + 1 < MAX_BVH_DEPTH && splitSpatialReferences(references, bounds, left, right, state)) {
+		references = {};
+		buildSpatialNode(tree, order, left, depth + 1, state);
+		tree[nodeIndex].offset = buildSpatialNode(tree, order, right, depth + 1, state);
+		return nodeIndex;
+	}
+	tree[nodeIndex].offset = order.size();
+	tree[nodeIndex].primitiveCount = references.size();
+	for (const SpatialReference& reference: references) { order.push_back(reference.primitive); }
+	return nodeIndex;
+}
+
+// Compares the best object split, binning the reference centroids, with the best spatial split, binning the node bounds.
+// A spatial split clips the references straddling its plane into both children, as long as the reference budget allows.
+// Returns false when no split separates the references.
+bool BoundingVolumeHierarchy::splitSpatialReferences(const std::vector<SpatialReference>& references, const BoundingBox& bounds, std::vector<SpatialReference>& left,
+                                                     std::vector<SpatialReference>& right, SpatialBuildState& state) {
+	BoundingBox centroidBounds;
+	for (const SpatialReference& reference: references) { centroidBounds.grow(reference.bounds.center()); }
+	Vector centroidExtent = centroidBounds.extent();
+	uint32_t binCount = state.options.binCount;
+	auto objectBinOf = [&centroidBounds, &centroidExtent, binCount](const SpatialReference& reference, uint32_t axis) {
+		auto bin = static_cast<uint32_t>((reference.bounds.center()[axis] - centroidBounds.min[axis]) / centroidExtent[axis] * binCount);
+		return std::min(bin, binCount - 1);
+	};
+	std::array<SahBins, 3> objectBins;
+	SahSplit objectSplit;
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		if (centroidExtent[axis] <= 0) { continue; }
+		for (const SpatialReference& reference: references) {
+			SahBin& bin = objectBins[axis][objectBinOf(reference, axis)];
+			bin.entries++;
+			bin.exits++;
+			bin.bounds.grow(reference.bounds);
+		}
+		sweepSahBins(objectBins[axis], binCount, axis, objectSplit);
+	}
+	double objectOverlapArea = std::numeric_limits<double>::infinity();
+	if (objectSplit.cost != std::numeric_limits<double>::infinity()) {
+		BoundingBox objectLeft;
+		BoundingBox objectRight;
+		for (uint32_t bin = 0; bin < binCount; bin++) { (bin <= objectSplit.bin ? objectLeft : objectRight).grow(objectBins[objectSplit.axis][bin].bounds); }
+		BoundingBox overlap = objectLeft.intersection(objectRight);
+		objectOverlapArea = overlap.empty() ? 0 : overlap.surfaceArea();
+	}
+
+	Vector extent = bounds.extent();
+	auto planeOf = [&bounds, &extent, binCount](uint32_t axis, uint32_t bin) { return bounds.min[axis] + extent[axis] * bin / binCount; };
+	auto spatialBinOf = [&bounds, &extent, binCount](double position, uint32_t axis) {
+		double bin = (position - bounds.min[axis]) / extent[axis] * binCount;
+		return static_cast<uint32_t>(std::clamp(bin, 0., binCount - 1.));
+	};
+	auto clip = [&state](const SpatialReference& reference, uint32_t axis, double min, double max) {
+		return state.clipper(reference.primitive, axis, min, max).intersection(reference.bounds);
+	};
+	SahSplit spatialSplit;
+	if (state.remainingReferences > 0 && objectOverlapArea > state.minOverlapArea) {
+		for (uint32_t axis = 0; axis < 3; axis++) {
+			if (extent[axis] <= 0) { continue; }
+			SahBins bins;
+			for (const SpatialReference& reference: references) {
+				uint32_t firstBin = spatialBinOf(reference.bounds.min[axis], axis);
+				uint32_t lastBin = spatialBinOf(reference.bounds.max[axis], axis);
+				bins[firstBin].entries++;
+				bins[lastBin].exits++;
+				if (firstBin == lastBin) {
+					bins[firstBin].bounds.grow(reference.bounds);
+					continue;
+				}
+				for (uint32_t bin = firstBin; bin <= lastBin; bin++) { bins[bin].bounds.grow(clip(reference, axis, planeOf(axis, bin), planeOf(axis, bin + 1))); }
+			}
+			sweepSahBins(bins, binCount, axis, spatialSplit);
+		}
+	}
+	auto count = static_cast<uint32_t>(references.size());
+	if (count <= state.options.maxLeafSize && isLeafCheaper(spatialSplit.cost < objectSplit.cost ? spatialSplit : objectSplit, count, bounds, state.options)) { return false; }
+
+	if (spatialSplit.cost < objectSplit.cost) {
+		uint32_t axis = spatialSplit.axis;
+		double plane = planeOf(axis, spatialSplit.bin + 1);
+		uint32_t duplicates = 0;
+		for (const SpatialReference& reference: references) {
+			if (spatialBinOf(reference.bounds.max[axis], axis) <= spatialSplit.bin) {
+				left.push_back(reference);
+			} else if (spatialBinOf(reference.bounds.min[axis], axis) > spatialSplit.bin) {
+				right.push_back(reference);
+			} else {
+				SpatialReference leftPart {.primitive = reference.primitive, .bounds = clip(reference, axis, -std::numeric_limits<double>::infinity(), plane)};
+				SpatialReference rightPart {.primitive = reference.primitive, .bounds = clip(reference, axis, plane, std::numeric_limits<double>::infinity())};
+				if (leftPart.bounds.empty()) {
+					right.push_back(reference);
+				} else if (rightPart.bounds.empty()) {
+					left.push_back(reference);
+				} else {
+					left.push_back(leftPart);
+					right.push_back(rightPart);
+					duplicates++;
+				}
+			}
+		}
+		if (!left.empty() && !right.empty() && duplicates <= state.remainingReferences) {
+			state.remainingReferences -= duplicates;
+			return true;
+		}
+		left.clear();
+		right.clear();
+	}
+
+	if (objectSplit.cost == std::numeric_limits<double>::infinity()) { return false; }
+	for (const SpatialReference& reference: references) {
+		(objectBinOf(reference, objectSplit.axis) <= objectSplit.bin ? left : right).push_back(reference);
+	}
+	return true;
+}
+
+// Splits between the codes that differ on the highest bit where the range is not uniform, in the middle if all codes are equal.
+static uint32_t findMortonSplit(const std::vector<uint64_t>& codes, uint32_t start, uint32_t end) {
+	uint64_t first = codes[start];
+	uint64_t last = codes[end - 1];
+	if (first == last) { return (start + end) / 2; }
+	int commonPrefix = std::countl_zero(first ^ last);
+	uint32_t low = start;
+	uint32_t high = end - 1;
+	while (low + 1 < high) {
+		uint32_t middle = (low + high) / 2;
+		if (std::countl_zero(first ^ codes[middle]) > commonPrefix) {
+			low = middle;
+		} else {
+			high = middle;
+		}
+	}
+	return high;
+}
+
+uint32_t BoundingVolumeHierarchy::buildMortonNode(std::vector<BvhNode>& tree, const std::vector<uint64_t>& codes, const std::vector<uint32_t>& order, uint32_t start, uint32_t end, uint32_t depth, const BuildInput& input) {
+	auto nodeIndex = static_cast<uint32_t>(tree.size());
+	tree.emplace_back();
+	if (end - start <= input.options.maxLeafSize || depth + 1 >= MAX_BVH_DEPTH) {
+		BoundingBox bounds;
+		for (uint32_t index = start; index < end; index++) { bounds.grow(input.primitiveBounds[order[index]]); }
+		tree[nodeIndex].setBounds(bounds);
+		tree[nodeIndex].offset = start;
+		tree[nodeIndex].primitiveCount = end - start;
+		return nodeIndex;
+	}
+	uint32_t pivot = findMortonSplit(codes, start, end);
+	if (end - start < PARALLEL_BUILD_THRESHOLD) {
+		buildMortonNode(tree, codes, order, start, pivot, depth + 1, input);
+		tree[nodeIndex].offset = buildMortonNode(tree, codes, order, pivot, end, depth + 1, input);
+	} else {
+		std::vector<BvhNode> left;
+		std::vector<BvhNode> right;
+#pragma omp task default(none) shared(left, codes, order, input) firstprivate(start, pivot, depth)
+		buildMortonNode(left, codes, order, start, pivot, depth + 1, input);
+#pragma omp task default(none) shared(right, codes, order, input) firstprivate(pivot, end, depth)
+		buildMortonNode(right, codes, order, pivot, end, depth + 1, input);
+#pragma omp taskwait
+		appendSubtree(tree, left);
+		tree[nodeIndex].offset = tree.size();
+		appendSubtree(tree, right);
+	}
+	BoundingBox bounds = tree[nodeIndex + 1].bounds();
+	bounds.grow(tree[tree[nodeIndex].offset].bounds());
+	tree[nodeIndex].setBounds(bounds);
+	return nodeIndex;
+}
@@ -0,0 +1,239 @@
+//
+// Created by remi on 18/10/26.
+//
+
+#ifndef BOUNDINGVOLUMEHIERARCHY_H
+#define BOUNDINGVOLUMEHIERARCHY_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "BoundingBox.h"
+#include "Ray.h"
+#include "Vector.h"
+
+struct RayPacket;
+
+// Nodes at this depth are always leaves, which bounds the size of the traversal stacks
+constexpr uint32_t MAX_BVH_DEPTH = 64;
+
+// Widens the far distance to make up for the rounding of the single precision slab tests
+constexpr float SLAB_PADDING = 1 + 4 * std::numeric_limits<float>::epsilon();
+
+enum class BvhBuilder {
+	Midpoint,   // split at the middle of the longest axis
+	BinnedSah,  // split minimizing the surface area heuristic over binned centroids
+	Morton,     // linear BVH: centroids sorted along a 63-bit Morton curve, split on the highest differing bit
+	SpatialSah, // binned SAH which may also split primitives at a plane, referencing them from both children
+};
+
+constexpr uint32_t MAX_SAH_BIN_COUNT = 32;
+
+// Memory order of the nodes of the wide layouts, the binary tree is always depth-first
+enum class BvhNodeOrder {
+	DepthFirst,
+	BreadthFirstTop, // the top levels breadth-first in one page, then each remaining subtree depth-first
+	VanEmdeBoas,     // recursively the top half of the levels, then each bottom subtree
+};
+
+// Tree traversed when rendering, the wide ones are collapsed from the binary tree
+enum class BvhLayout {
+	Binary,
+	Wide4,       // four children per node, tested with SSE
+	Wide8,       // eight children per node, tested with AVX when available
+	Compressed4, // Wide4 with 8-bit child bounds, one cache line per node
+	Compressed8, // Wide8 with 8-bit child bounds, two cache lines per node
+};
+
+struct BvhBuildOptions {
+	BvhBuilder builder = BvhBuilder::BinnedSah;
+	uint32_t maxLeafSize = 4;
+	// Costs of visiting a node and of testing a primitive: SAH builders stop splitting ranges of at most
+	// maxLeafSize primitives when testing them all is cheaper than the best split
+	double traversalCost = 1;
+	double intersectionCost = 1;
+	double refitRebuildRatio = 1.5;   // a refitted tree whose SAH cost grew past this ratio of its cost when built is rebuilt from scratch
+	uint32_t binCount = 16;           // between 2 and MAX_SAH_BIN_COUNT
+	double spatialSplitBudget = 0.25; // maximum number of references added by spatial splits, as a fraction of the primitive count
+	BvhNodeOrder nodeOrder = BvhNodeOrder::DepthFirst;
+	BvhLayout layout = BvhLayout::Wide4;
+};
+
+// Position along a 63-bit Morton curve, 21 bits per axis, of a point inside bounds
+[[nodiscard]] uint64_t mortonCode(const Vector& point, const BoundingBox& bounds);
+// Sorts codes on their keyBits low bits, moving order along.
+// LSD radix sort on 8-bit digits with per-chunk histograms: stable, so the order does not depend on the number of threads.
+void radixSort(std::vector<uint64_t>& codes, std::vector<uint32_t>& order, uint32_t keyBits = 63);
+
+// Bounds of the part of a primitive lying between min and max along axis
+typedef std::function<BoundingBox(uint32_t primitive, uint32_t axis, double min, double max)> PrimitiveClipper;
+
+// Bounds are stored in single precision, rounded outwards so that the node still encloses its primitives.
+struct alignas(32) BvhNode {
+	struct IntersectResult {
+		double distance = 0;
+		bool result = false;
+	};
+
+	std::array<float, 3> min {};
+	uint32_t offset = 0;         // first primitive of a leaf, second child of an interior node (the first child follows its parent)
+	std::array<float, 3> max {};
+	uint32_t primitiveCount = 0; // 0 for interior nodes
+
+	void setBounds(const BoundingBox& box);
+	[[nodiscard]] BoundingBox bounds() const;
+	[[nodiscard]] bool isLeaf() const;
+	[[nodiscard]] IntersectResult intersect(const Ray& ray) const;
+	// Lanes of mask whose ray enters the box before its distance, nearest gets their smallest entry distance
+	[[nodiscard]] uint32_t intersect(const RayPacket& packet, uint32_t mask, float& nearest) const;
+};
+
+static_assert(sizeof(BvhNode) == 32);
+static_assert(std::is_trivially_copyable_v<BvhNode>);
+
+
+struct BvhStatistics {
+	uint32_t nodeCount = 0;
+	uint32_t leafCount = 0;
+	uint32_t maxDepth = 0;
+	double averageLeafDepth = 0;
+	std::vector<uint32_t> leafSizes; // number of leaves per primitive count
+	double sahCost = 0;
+	double siblingOverlap = 0; // mean over interior nodes of the area shared by both children, relative to the node area
+};
+
+// Fixed capacity stack kept on the call stack, so that traversing a BVH never allocates.
+template<typename T, uint32_t Capacity>
+class TraversalStack {
+public:
+	void push(const T& value) { entries[size++] = value; }
+	T pop() { return entries[--size]; }
+	[[nodiscard]] bool empty() const { return size == 0; }
+
+private:
+	std::array<T, Capacity> entries;
+	uint32_t size = 0;
+};
+
+
+class BoundingVolumeHierarchy {
+public:
+	// Builds the tree over the given primitives and returns the primitive order the leaf ranges refer to.
+	// With spatial splits, a primitive may appear several times in this order; the SpatialSah builder
+	// falls back to BinnedSah without a clipper.
+	[[nodiscard]] std::vector<uint32_t> build(const std::vector<BoundingBox>& primitiveBounds, const std::vector<Vector>& centroids, const BvhBuildOptions& options,
+	                                          const PrimitiveClipper& clipper = {});
+	// Recomputes the bounds bottom-up for moved primitives, given in the order returned by build(), keeping the topology
+	void refit(const std::vector<BoundingBox>& primitiveBounds);
+	// Checks that the nodes, e.g. read from a file, form a depth-first tree of at most MAX_BVH_DEPTH levels
+	// whose leaves refer to primitives below primitiveCount, so that traversals stay in bounds
+	[[nodiscard]] bool valid(size_t primitiveCount) const;
+	// Expected cost of a ray hitting the root, counting one per node visited and one per primitive tested
+	[[nodiscard]] double sahCost() const;
+	[[nodiscard]] BvhStatistics statistics() const;
+	[[nodiscard]] size_t byteSize() const;
+	// Visits the leaves hit before tMax from front to back. leaf(start, end) may lower tMax,
+	// which is read back after each leaf, and returns true to stop the traversal.
+	template<typename LeafFunction>
+	void traverse(const Ray& ray, const double& tMax, LeafFunction&& leaf) const;
+	// Visits the leaves reached by at least one lane of mask, nearest first. leaf(start, end, laneMask) gets the lanes
+	// reaching it, may lower their distance in the packet and returns true to stop the traversal.
+	template<typename LeafFunction>
+	void traverse(const RayPacket& packet, uint32_t mask, LeafFunction&& leaf) const;
+
+	std::vector<BvhNode> nodes; // depth-first order, root first
+	double builtSahCost = 0;
+
+private:
+	struct BuildInput {
+		const std::vector<BoundingBox>& primitiveBounds;
+		const std::vector<Vector>& centroids;
+		const BvhBuildOptions& options;
+	};
+	struct SpatialReference;
+	struct SpatialBuildState;
+
+	static uint32_t buildNode(std::vector<BvhNode>& tree, std::vector<uint32_t>& order, uint32_t start, uint32_t end, uint32_t depth, const BuildInput& input);
+	BoundingBox refitNode(uint32_t nodeIndex, const std::vector<BoundingBox>& primitiveBounds);
+	static uint32_t buildMortonNode(std::vector<BvhNode>& tree, const std::vector<uint64_t>& codes, const std::vector<uint32_t>& order, uint32_t start, uint32_t end, uint32_t depth, const BuildInput& input);
+	[[nodiscard]] static uint32_t splitMidpoint(std::vector<uint32_t>& order, uint32_t start, uint32_t end, const BoundingBox& bounds, const BuildInput& input);
+	[[nodiscard]] static uint32_t splitBinnedSah(std::vector<uint32_t>& order, uint32_t start, uint32_t end, const BoundingBox& bounds, const BuildInput& input);
+	static uint32_t buildSpatialNode(std::vector<BvhNode>& tree, std::vector<uint32_t>& order, std::vector<SpatialReference>& references, uint32_t depth, SpatialBuildState& state);
+	static bool splitSpatialReferences(const std::vector<SpatialReference>& references, const BoundingBox& bounds, std::vector<SpatialReference>& left, std::vector<SpatialReference>& right, SpatialBuildState& state);
+};
+
+template<typename LeafFunction>
+void BoundingVolumeHierarchy::traverse(const Ray& ray, const double& tMax, LeafFunction&& leaf) const {
+	if (nodes.empty()) { return; }
+	BvhNode::IntersectResult rootIntersect = nodes[0].intersect(ray);
+	if (!rootIntersect.result || rootIntersect.distance > tMax) { return; }
+	struct Entry {
+		uint32_t node;
+		double distance;
+	};
+	TraversalStack<Entry, MAX_BVH_DEPTH + 1> stack;
+	stack.push({0, rootIntersect.distance});
+	while (!stack.empty()) {
+		auto [nodeIndex, distance] = stack.pop();
+		if (distance > tMax) { continue; }
+		const BvhNode& node = nodes[nodeIndex];
+		if (node.isLeaf()) {
+			if (leaf(node.offset, node.offset + node.primitiveCount)) { return; }
+			continue;
+		}
+		uint32_t nearChild = nodeIndex + 1;
+		uint32_t farChild = node.offset;
+		BvhNode::IntersectResult nearIntersect = nodes[nearChild].intersect(ray);
+		BvhNode::IntersectResult farIntersect = nodes[farChild].intersect(ray);
+		if (farIntersect.distance < nearIntersect.distance) {
+			std::swap(nearChild, farChild);
+			std::swap(nearIntersect, farIntersect);
+		}
+		if (farIntersect.result && farIntersect.distance < tMax) { stack.push({farChild, farIntersect.distance}); }
+		if (nearIntersect.result && nearIntersect.distance < tMax) { stack.push({nearChild, nearIntersect.distance}); }
+	}
+}
+
+template<typename LeafFunction>
+void BoundingVolumeHierarchy::traverse(const RayPacket& packet, uint32_t mask, LeafFunction&& leaf) const {
+	if (nodes.empty()) { return; }
+	float rootDistance;
+	uint32_t rootMask = nodes[0].intersect(packet, mask, rootDistance);
+	if (rootMask == 0) { return; }
+	struct Entry {
+		uint32_t node;
+		uint32_t mask;
+	};
+	TraversalStack<Entry, MAX_BVH_DEPTH + 1> stack;
+	stack.push({0, rootMask});
+	while (!stack.empty()) {
+		auto [nodeIndex, nodeMask] = stack.pop();
+		const BvhNode& node = nodes[nodeIndex];
+		if (node.isLeaf()) {
+			// lanes may have found closer hits since the leaf was pushed
+			float distance;
+			nodeMask = node.intersect(packet, nodeMask, distance);
+			if (nodeMask != 0 && leaf(node.offset, node.offset + node.primitiveCount, nodeMask)) { return; }
+			continue;
+		}
+		uint32_t nearChild = nodeIndex + 1;
+		uint32_t farChild = node.offset;
+		float nearDistance, farDistance;
+		uint32_t nearMask = nodes[nearChild].intersect(packet, nodeMask, nearDistance);
+		uint32_t farMask = nodes[farChild].intersect(packet, nodeMask, farDistance);
+		if (farDistance < nearDistance) {
+			std::swap(nearChild, farChild);
+			std::swap(nearMask, farMask);
+		}
+		if (farMask != 0) { stack.push({farChild, farMask}); }
+		if (nearMask != 0) { stack.push({nearChild, nearMask}); }
+	}
+}
+
+#endif //BOUNDINGVOLUMEHIERARCHY_H
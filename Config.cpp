@@ -4,11 +4,15 @@
 
 #include "Config.h"
 
+#include <algorithm>
+#include <array>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <vector>
 
+#include "RayPacket.h"
+
 // Taken from https://stackoverflow.com/a/46711735
 constexpr uint32_t hash(const std::string_view data) noexcept {
 	uint32_t hash = 5385;
@@ -20,15 +24,104 @@ constexpr uint32_t hash(const std::string_view data) noexcept {
 
 constexpr uint32_t operator ""_(const char* p, size_t) { return hash(p); }
 
+// Returns false if key is not a BVH option
+static bool readBvhOption(const std::string& key, const std::string& value, BvhBuildOptions& options) {
+	switch (hash(key)) {
+		case "bvhBuilder"_:
+			switch (hash(value)) {
+				case "Midpoint"_:
+					options.builder = BvhBuilder::Midpoint;
+					break;
+				case "BinnedSah"_:
+					options.builder = BvhBuilder::BinnedSah;
+					break;
+				case "Morton"_:
+					options.builder = BvhBuilder::Morton;
+					break;
+				case "SpatialSah"_:
+					options.builder = BvhBuilder::SpatialSah;
+					break;
+				default:
+					std::cerr << "Warning: Unknown BVH builder '" << value << "'\n";
+			}
+			return true;
+		case "bvhMaxLeafSize"_:
+			options.maxLeafSize = std::stoul(value);
+			return true;
+		case "bvhTraversalCost"_:
+			options.traversalCost = std::stod(value);
+			return true;
+		case "bvhIntersectionCost"_:
+			options.intersectionCost = std::stod(value);
+			return true;
+		case "bvhRefitRebuildRatio"_:
+			options.refitRebuildRatio = std::stod(value);
+			return true;
+		case "bvhBinCount"_:
+			options.binCount = std::stoul(value);
+			return true;
+		case "bvhSpatialSplitBudget"_:
+			options.spatialSplitBudget = std::stod(value);
+			return true;
+		case "bvhNodeOrder"_:
+			switch (hash(value)) {
+				case "DepthFirst"_:
+					options.nodeOrder = BvhNodeOrder::DepthFirst;
+					break;
+				case "BreadthFirstTop"_:
+					options.nodeOrder = BvhNodeOrder::BreadthFirstTop;
+					break;
+				case "VanEmdeBoas"_:
+					options.nodeOrder = BvhNodeOrder::VanEmdeBoas;
+					break;
+				default:
+					std::cerr << "Warning: Unknown BVH node order '" << value << "'\n";
+			}
+			return true;
+		case "bvhLayout"_:
+			switch (hash(value)) {
+				case "Binary"_:
+					options.layout = BvhLayout::Binary;
+					break;
+				case "Wide4"_:
+					options.layout = BvhLayout::Wide4;
+					break;
+				case "Wide8"_:
+					options.layout = BvhLayout::Wide8;
+#if !defined(__AVX__)
+					std::cerr << "Warning: Wide8 nodes are tested without AVX, build with NATIVE_ARCH to enable it\n";
+#endif
+					break;
+				case "Compressed4"_:
+					options.layout = BvhLayout::Compressed4;
+					break;
+				case "Compressed8"_:
+					options.layout = BvhLayout::Compressed8;
+					break;
+				default:
+					std::cerr << "Warning: Unknown BVH layout '" << value << "'\n";
+			}
+			return true;
+		default:
+			return false;
+	}
+}
+
 void readConfig(const std::string& file, Config& config) {
 	std::ifstream stream(file);
 	std::string line;
+	std::vector<std::array<std::string, 3>> meshOptions;
 	while (std::getline(stream, line)) {
 		std::erase_if(line, isspace);
 		std::istringstream lineStream(line);
 		std::string key;
 		std::string value;
 		if (!std::getline(lineStream, key, '=') || !std::getline(lineStream, value)) { continue; }
+		if (size_t dot = key.find('.'); dot != std::string::npos) {
+			meshOptions.push_back({key.substr(0, dot), key.substr(dot + 1), value});
+			continue;
+		}
+		if (readBvhOption(key, value, config.bvh)) { continue; }
 		switch (hash(key)) {
 			case "height"_:
 				config.height = std::stoi(value);
@@ -48,10 +141,57 @@ void readConfig(const std::string& file, Config& config) {
 			case "focusDistance"_:
 				config.focusDistance = std::stod(value);
 				break;
+			case "primaryRayPacketSize"_:
+				config.primaryRayPacketSize = std::stoi(value);
+				if (config.primaryRayPacketSize < 1 || config.primaryRayPacketSize > static_cast<int>(RayPacket::MAX_SIZE)) {
+					std::cerr << "Warning: primaryRayPacketSize must be between 1 and " << RayPacket::MAX_SIZE << '\n';
+					config.primaryRayPacketSize = std::clamp(config.primaryRayPacketSize, 1, static_cast<int>(RayPacket::MAX_SIZE));
+				}
+				break;
+			case "integrator"_:
+				switch (hash(value)) {
+					case "Recursive"_:
+						config.integrator = Integrator::Recursive;
+						break;
+					case "Wavefront"_:
+						config.integrator = Integrator::Wavefront;
+						break;
+					default:
+						std::cerr << "Warning: Unknown integrator '" << value << "'\n";
+				}
+				break;
+			case "secondaryRayOrder"_:
+				switch (hash(value)) {
+					case "Unsorted"_:
+						config.secondaryRayOrder = RayOrder::Unsorted;
+						break;
+					case "Morton"_:
+						config.secondaryRayOrder = RayOrder::Morton;
+						break;
+					default:
+						std::cerr << "Warning: Unknown ray order '" << value << "'\n";
+				}
+				break;
+			case "precision"_:
+				switch (hash(value)) {
+					case "Double"_:
+						config.precision = GeometryPrecision::Double;
+						break;
+					case "Float"_:
+						config.precision = GeometryPrecision::Float;
+						break;
+					default:
+						std::cerr << "Warning: Unknown precision '" << value << "'\n";
+				}
+				break;
 			default:
 				std::cerr << "Warning: Unknown config key '" << key << "'\n";
 		}
 	}
+	for (const auto& [mesh, key, value]: meshOptions) {
+		auto [options, inserted] = config.meshBvh.try_emplace(mesh, config.bvh);
+		if (!readBvhOption(key, value, options->second)) { std::cerr << "Warning: Unknown config key '" << mesh << '.' << key << "'\n"; }
+	}
 	std::vector<std::pair<std::string, int>> fields {
 		{"height", config.height},
 		{"width", config.width},
@@ -66,3 +206,8 @@ void readConfig(const std::string& file, Config& config) {
 		}
 	}
 }
+
+const BvhBuildOptions& Config::bvhOptions(const std::string& mesh) const {
+	auto options = meshBvh.find(mesh);
+	return options != meshBvh.end() ? options->second : bvh;
+}
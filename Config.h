@@ -5,8 +5,23 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <map>
 #include <string>
 
+#include "BoundingVolumeHierarchy.h"
+#include "TrianglePacket.h"
+
+enum class Integrator {
+	Recursive, // each path traced from start to end by its own thread
+	Wavefront  // all the paths of a batch extended bounce by bounce, see Scene::renderWavefront
+};
+
+// Order in which the wavefront integrator traces the rays of the paths after their first bounce
+enum class RayOrder {
+	Unsorted, // order of the pixels
+	Morton    // grouped by direction octant, then along a Morton curve over the origins
+};
+
 struct Config {
 	int height = -1;
 	int width = -1;
@@ -14,6 +29,14 @@ struct Config {
 	int raysPerPixel = -1;
 	int maxBounce = -1;
 	double focusDistance = -1;
+	GeometryPrecision precision = GeometryPrecision::Double;
+	int primaryRayPacketSize = 1; // camera rays of a pixel traced together, 1 to trace them one by one
+	Integrator integrator = Integrator::Recursive;
+	RayOrder secondaryRayOrder = RayOrder::Unsorted;
+	BvhBuildOptions bvh;                            // bvh* keys
+	std::map<std::string, BvhBuildOptions> meshBvh; // <mesh>.bvh* keys, applied over the global ones
+
+	[[nodiscard]] const BvhBuildOptions& bvhOptions(const std::string& mesh) const;
 };
 
 void readConfig(const std::string& file, Config& config);
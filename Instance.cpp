@@ -0,0 +1,59 @@
+//
+// Created by remi on 18/10/26.
+//
+
+#include "Instance.h"
+
+Instance::Instance(const TriangleMesh* mesh): Object(*mesh), mesh(mesh) {}
+
+void Instance::scaleTranslate(double scale, const Vector& translation) {
+	for (Vector& axis: axes) { axis = axis * scale; }
+	this->translation = this->translation * scale + translation;
+	updateInverse();
+}
+
+void Instance::rotate(double angleRad, uint32_t axis) {
+	for (Vector& meshAxis: axes) { meshAxis.rotate(angleRad, axis); }
+	translation.rotate(angleRad, axis);
+	updateInverse();
+}
+
+void Instance::updateInverse() {
+	double determinant = axes[0].dot(axes[1].cross(axes[2]));
+	inverseRows = {axes[1].cross(axes[2]) / determinant, axes[2].cross(axes[0]) / determinant, axes[0].cross(axes[1]) / determinant};
+}
+
+// The direction is not normalized, so that distances along the ray are the same in both spaces
+Ray Instance::toMesh(const Ray& ray) const {
+	Vector origin = ray.origin - translation;
+	return {
+		Vector(inverseRows[0].dot(origin), inverseRows[1].dot(origin), inverseRows[2].dot(origin)),
+		Vector(inverseRows[0].dot(ray.direction), inverseRows[1].dot(ray.direction), inverseRows[2].dot(ray.direction))
+	};
+}
+
+Object::Hit Instance::closestHit(const Ray& ray, double tMax) const {
+	return mesh->closestHit(toMesh(ray), tMax);
+}
+
+Object::IntersectResult Instance::hitAttributes(const Ray& ray, const Hit& hit) const {
+	IntersectResult attributes = mesh->hitAttributes(toMesh(ray), hit);
+	// Normals go through the inverse transpose
+	Vector normal = inverseRows[0] * attributes.normal[0] + inverseRows[1] * attributes.normal[1] + inverseRows[2] * attributes.normal[2];
+	return {.impact = ray.origin + attributes.distance * ray.direction, .normal = normal.normalized(), .distance = attributes.distance, .albedo = attributes.albedo, .result = true};
+}
+
+bool Instance::occluded(const Ray& ray, double tMax) const {
+	return mesh->occluded(toMesh(ray), tMax);
+}
+
+BoundingBox Instance::boundingBox() const {
+	BoundingBox meshBox = mesh->boundingBox();
+	BoundingBox box;
+	for (uint32_t corner = 0; corner < 8; corner++) {
+		Vector point = translation;
+		for (uint32_t axis = 0; axis < 3; axis++) { point += axes[axis] * ((corner >> axis & 1) != 0 ? meshBox.max[axis] : meshBox.min[axis]); }
+		box.grow(point);
+	}
+	return box;
+}
@@ -0,0 +1,40 @@
+//
+// Created by remi on 18/10/26.
+//
+
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include <array>
+
+#include "Object.h"
+#include "TriangleMesh.h"
+#include "Vector.h"
+
+// Places a mesh through an affine transform, sharing its triangles and BVH with every other instance of it.
+// Rays are moved to the mesh space rather than the mesh to the world, the mesh must outlive its instances.
+class Instance: public Object {
+public:
+	// Starts with the identity transform and the material of the mesh
+	explicit Instance(const TriangleMesh* mesh);
+
+	// Same conventions as TriangleMesh, applied after the current transform
+	void scaleTranslate(double scale, const Vector& translation);
+	void rotate(double angleRad, uint32_t axis);
+	[[nodiscard]] Hit closestHit(const Ray& ray, double tMax) const override;
+	[[nodiscard]] IntersectResult hitAttributes(const Ray& ray, const Hit& hit) const override;
+	[[nodiscard]] bool occluded(const Ray& ray, double tMax) const override;
+	[[nodiscard]] BoundingBox boundingBox() const override;
+
+	const TriangleMesh* mesh;
+
+private:
+	[[nodiscard]] Ray toMesh(const Ray& ray) const;
+	void updateInverse();
+
+	std::array<Vector, 3> axes {Vector(1, 0, 0), Vector(0, 1, 0), Vector(0, 0, 1)}; // images of the mesh axes
+	Vector translation;
+	std::array<Vector, 3> inverseRows {Vector(1, 0, 0), Vector(0, 1, 0), Vector(0, 0, 1)}; // rows of the inverse of axes
+};
+
+#endif //INSTANCE_H
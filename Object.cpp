@@ -4,11 +4,31 @@
 
 #include "Object.h"
 
+#include <bit>
 #include <cmath>
 
 Object::Object(const Vector& albedo): albedo(albedo) {}
 Object::Object(AlbedoFunction albedo): hasVariableAlbedo(true), albedoFunction(std::move(albedo)) {}
 
+Object::IntersectResult Object::intersect(const Ray& ray) const {
+	Hit hit = closestHit(ray, std::numeric_limits<double>::infinity());
+	if (!hit.result) { return {}; }
+	return hitAttributes(ray, hit);
+}
+
+uint32_t Object::closestHits(RayPacket& packet, uint32_t mask, std::array<Hit, RayPacket::MAX_SIZE>& hits) const {
+	uint32_t improved = 0;
+	for (; mask != 0; mask &= mask - 1) {
+		auto lane = static_cast<uint32_t>(std::countr_zero(mask));
+		Hit hit = closestHit(packet.ray(lane), hits[lane].distance);
+		if (!hit.result) { continue; }
+		hits[lane] = hit;
+		packet.setDistance(lane, hit.distance);
+		improved |= 1u << lane;
+	}
+	return improved;
+}
+
 Object::AlbedoFunction AlbedoFunctions::checkerboard(uint32_t axis, double size, Vector albedo1, Vector albedo2) {
 	return [axis, size, albedo1, albedo2](const Vector& impact) {
 		bool i1 = static_cast<int>(std::floor(impact[(axis + 1) % 3] / size)) & 1;
@@ -6,8 +6,11 @@
 #define OBJECT_H
 
 #include <functional>
+#include <limits>
 
+#include "BoundingBox.h"
 #include "Ray.h"
+#include "RayPacket.h"
 
 class Object {
 public:
@@ -21,7 +24,25 @@ public:
 		bool result = false;
 	};
 
-	[[nodiscard]] virtual IntersectResult intersect(const Ray& ray) const = 0;
+	// What traversal keeps of a hit, the shading attributes are only computed for the closest one
+	struct Hit {
+		double distance = std::numeric_limits<double>::infinity();
+		uint32_t primitive = 0;
+		double beta = 0;  // barycentric coordinates, for triangles
+		double gamma = 0;
+		bool result = false;
+	};
+
+	// Closest hit strictly before tMax
+	[[nodiscard]] virtual Hit closestHit(const Ray& ray, double tMax) const = 0;
+	[[nodiscard]] virtual IntersectResult hitAttributes(const Ray& ray, const Hit& hit) const = 0;
+	[[nodiscard]] IntersectResult intersect(const Ray& ray) const;
+	// Replaces hits[lane] for the lanes of mask finding a closer hit than its distance, lowering their distance in the packet.
+	// Returns these lanes. Tests the lanes one by one unless overridden.
+	virtual uint32_t closestHits(RayPacket& packet, uint32_t mask, std::array<Hit, RayPacket::MAX_SIZE>& hits) const;
+	// Any-hit query: whether something lies on the ray before tMax, without computing the hit attributes
+	[[nodiscard]] virtual bool occluded(const Ray& ray, double tMax) const = 0;
+	[[nodiscard]] virtual BoundingBox boundingBox() const = 0;
 
 	explicit Object(const Vector& albedo);
 	explicit Object(AlbedoFunction albedo);
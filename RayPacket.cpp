@@ -0,0 +1,35 @@
+//
+// Created by remi on 18/10/26.
+//
+
+#include "RayPacket.h"
+
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+void RayPacket::add(const Ray& ray) {
+	if (size == MAX_SIZE) { throw std::runtime_error("RayPacket is full"); }
+	origins[size] = ray.origin;
+	directions[size] = ray.direction;
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		origin[axis][size] = static_cast<float>(ray.origin[axis]);
+		inverseDirection[axis][size] = static_cast<float>(1 / ray.direction[axis]);
+	}
+	tMax[size] = std::numeric_limits<float>::infinity();
+	size++;
+}
+
+Ray RayPacket::ray(uint32_t lane) const {
+	return {origins[lane], directions[lane]};
+}
+
+uint32_t RayPacket::mask() const {
+	return (1u << size) - 1;
+}
+
+// Rounded up, so that the box tests never cull a hit lying exactly at the distance
+void RayPacket::setDistance(uint32_t lane, double distance) {
+	auto rounded = static_cast<float>(distance);
+	tMax[lane] = rounded < distance ? std::nextafter(rounded, std::numeric_limits<float>::infinity()) : rounded;
+}
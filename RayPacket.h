@@ -0,0 +1,33 @@
+//
+// Created by remi on 18/10/26.
+//
+
+#ifndef RAYPACKET_H
+#define RAYPACKET_H
+
+#include <array>
+#include <cstdint>
+
+#include "Ray.h"
+#include "Vector.h"
+
+// Rays traced together through the same BVH nodes, such as the camera rays of one pixel.
+// The single precision copies are stored as structure of arrays (origin[axis][lane]) for the box tests.
+struct RayPacket {
+	static constexpr uint32_t MAX_SIZE = 16;
+
+	void add(const Ray& ray);
+	[[nodiscard]] Ray ray(uint32_t lane) const;
+	[[nodiscard]] uint32_t mask() const;
+	// Lowers the distance up to which the boxes are tested for this lane
+	void setDistance(uint32_t lane, double distance);
+
+	uint32_t size = 0;
+	std::array<Vector, MAX_SIZE> origins;
+	std::array<Vector, MAX_SIZE> directions;
+	alignas(16) std::array<std::array<float, MAX_SIZE>, 3> origin {};
+	alignas(16) std::array<std::array<float, MAX_SIZE>, 3> inverseDirection {};
+	alignas(16) std::array<float, MAX_SIZE> tMax {};
+};
+
+#endif //RAYPACKET_H
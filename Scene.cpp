@@ -4,10 +4,13 @@
 
 #include "Scene.h"
 
+#include <algorithm>
+#include <bit>
 #include <limits>
 #include <cmath>
 #include <iostream>
 #include <omp.h>
+#include <stdexcept>
 
 #include "Config.h"
 
@@ -66,84 +69,318 @@ void Scene::addMesh(const TriangleMesh* mesh) {
 	objects.push_back(mesh);
 }
 
+void Scene::addInstance(const Instance* instance) {
+	objects.push_back(instance);
+}
 
-Scene::IntersectResult Scene::intersect(const Ray& ray) const {
-	bool hasInter = false;
-	double minT = std::numeric_limits<double>::infinity();
-	Vector normal;
-	Vector impact;
-	Vector albedo;
-	const Object* hitObject = nullptr;
+
+void Scene::buildBvh() {
+	BvhBuildOptions options;
+	if (bvhObjects.size() == objects.size() && !bvh.nodes.empty()) {
+		std::vector<BoundingBox> objectBounds;
+		for (const Object* object: bvhObjects) { objectBounds.push_back(object->boundingBox()); }
+		bvh.refit(objectBounds);
+		if (bvh.sahCost() <= options.refitRebuildRatio * bvh.builtSahCost) { return; }
+	}
+	std::vector<BoundingBox> objectBounds;
+	std::vector<Vector> centers;
 	for (const Object* object: objects) {
-		Object::IntersectResult intersect = object->intersect(ray);
-		if (intersect.result) {
-			hasInter = true;
-			if (intersect.distance < minT) {
-				normal = intersect.normal;
-				impact = intersect.impact;
-				minT = intersect.distance;
-				albedo = intersect.albedo;
-				hitObject = object;
+		objectBounds.push_back(object->boundingBox());
+		centers.push_back(objectBounds.back().center());
+	}
+	bvhObjects.clear();
+	for (const uint32_t& index: bvh.build(objectBounds, centers, options)) { bvhObjects.push_back(objects[index]); }
+}
+
+Scene::IntersectResult Scene::intersect(const Ray& ray) const {
+	if (bvhObjects.size() != objects.size()) { throw std::runtime_error("Scene::buildBvh must be called after adding objects"); }
+	Object::Hit bestHit;
+	const Object* bestObject = nullptr;
+	bvh.traverse(ray, bestHit.distance, [this, &ray, &bestHit, &bestObject](uint32_t start, uint32_t end) {
+		for (uint32_t index = start; index < end; index++) {
+			Object::Hit hit = bvhObjects[index]->closestHit(ray, bestHit.distance);
+			if (hit.result && hit.distance < bestHit.distance) {
+				bestHit = hit;
+				bestObject = bvhObjects[index];
 			}
 		}
+		return false;
+	});
+	if (bestObject == nullptr) { return {.impact = {}, .normal = {}, .object = nullptr, .distance = bestHit.distance, .albedo = {}}; }
+	// Only the closest hit gets its normal and albedo evaluated
+	Object::IntersectResult attributes = bestObject->hitAttributes(ray, bestHit);
+	return {.impact = attributes.impact, .normal = attributes.normal, .object = bestObject, .distance = attributes.distance, .albedo = attributes.albedo, .result = true};
+}
+
+void Scene::intersect(RayPacket& packet, std::array<IntersectResult, RayPacket::MAX_SIZE>& intersections) const {
+	if (bvhObjects.size() != objects.size()) { throw std::runtime_error("Scene::buildBvh must be called after adding objects"); }
+	std::array<Object::Hit, RayPacket::MAX_SIZE> bestHits {};
+	std::array<const Object*, RayPacket::MAX_SIZE> bestObjects {};
+	bvh.traverse(packet, packet.mask(), [this, &packet, &bestHits, &bestObjects](uint32_t start, uint32_t end, uint32_t laneMask) {
+		for (uint32_t index = start; index < end; index++) {
+			for (uint32_t improved = bvhObjects[index]->closestHits(packet, laneMask, bestHits); improved != 0; improved &= improved - 1) {
+				bestObjects[static_cast<uint32_t>(std::countr_zero(improved))] = bvhObjects[index];
+			}
+		}
+		return false;
+	});
+	for (uint32_t lane = 0; lane < packet.size; lane++) {
+		if (bestObjects[lane] == nullptr) {
+			intersections[lane] = {.impact = {}, .normal = {}, .object = nullptr, .distance = bestHits[lane].distance, .albedo = {}};
+			continue;
+		}
+		Object::IntersectResult attributes = bestObjects[lane]->hitAttributes(packet.ray(lane), bestHits[lane]);
+		intersections[lane] = {.impact = attributes.impact, .normal = attributes.normal, .object = bestObjects[lane], .distance = attributes.distance, .albedo = attributes.albedo, .result = true};
 	}
-	return {.impact = impact, .normal = normal, .object = hitObject, .distance = minT, .albedo = albedo, .result = hasInter};
+}
+
+bool Scene::occluded(const Ray& ray, double tMax) const {
+	if (bvhObjects.size() != objects.size()) { throw std::runtime_error("Scene::buildBvh must be called after adding objects"); }
+	bool hit = false;
+	bvh.traverse(ray, tMax, [this, &ray, tMax, &hit](uint32_t start, uint32_t end) {
+		hit = std::any_of(bvhObjects.begin() + start, bvhObjects.begin() + end, [&ray, tMax](const Object* object) { return object->occluded(ray, tMax); });
+		return hit;
+	});
+	return hit;
 }
 
 Vector Scene::getColor(const Ray& ray, int maxBounce, bool isIndirect) const {
-	IntersectResult intersection = intersect(ray);
-	if (maxBounce < 0 || !intersection.result) { return {0, 0, 0}; }
-	if (intersection.object->isTransparent) { return refractIntersection(ray, intersection, maxBounce); }
-	if (intersection.object->mirrors) { return bounceIntersection(ray, intersection, maxBounce); }
-	if (intersection.object->isLight) {
-		if (isIndirect) { return {0, 0, 0}; }
-		double power = lightSource->lightPower / (4 * M_PI * M_PI * lightSource->radius * lightSource->radius);
-		return {power, power, power};
+	return shade(ray, intersect(ray), maxBounce, isIndirect);
+}
+
+// Follows the path iteratively from its first hit, the albedos met so far are carried in throughput.
+// Every scattering uses one bounce, so the loop runs at most maxBounce + 1 times and the last hit scatters no ray.
+Vector Scene::shade(const Ray& cameraRay, const IntersectResult& firstIntersection, int maxBounce, bool isIndirect) const {
+	Vector color;
+	Vector throughput(1, 1, 1);
+	Ray ray = cameraRay;
+	IntersectResult intersection = firstIntersection;
+	for (; maxBounce >= 0 && intersection.result; maxBounce--) {
+		switch (material(intersection)) {
+			case Material::Transparent:
+				if (maxBounce == 0) { return color; }
+				ray = transmittedRay(ray, intersection);
+				isIndirect = false;
+				break;
+			case Material::Mirror:
+				if (maxBounce == 0) { return color; }
+				ray = reflectedRay(ray, intersection);
+				isIndirect = false;
+				break;
+			case Material::Light:
+				if (!isIndirect) { color += throughput * lightEmission(); }
+				return color;
+			default: { // Diffuse
+				LightSample light = sampleLight(intersection);
+				if (!occluded(light.shadowRay, light.distance)) { color += throughput * light.contribution; }
+				if (maxBounce == 0) { return color; }
+				throughput = throughput * intersection.albedo;
+				ray = diffuseRay(intersection);
+				isIndirect = true;
+			}
+		}
+		intersection = intersect(ray);
 	}
+	return color;
+}
+
+Scene::Material Scene::material(const IntersectResult& intersection) {
+	if (!intersection.result) { return Material::Miss; }
+	if (intersection.object->isTransparent) { return Material::Transparent; }
+	if (intersection.object->mirrors) { return Material::Mirror; }
+	if (intersection.object->isLight) { return Material::Light; }
+	return Material::Diffuse;
+}
+
+double Scene::lightEmission() const {
+	return lightSource->lightPower / (4 * M_PI * M_PI * lightSource->radius * lightSource->radius);
+}
+
+// Samples a point of the light sphere, seen from a diffuse hit
+Scene::LightSample Scene::sampleLight(const IntersectResult& intersection) const {
 	Vector travel = lightSource->center - intersection.impact;
 	Vector lightDirection = travel.normalized();
 	Vector nPrime = cosRandomVector(-lightDirection);
 	Vector randomLightPath = nPrime * lightSource->radius + lightSource->center - intersection.impact;
 	double distance_2 = randomLightPath.norm2();
 	Vector randomLightDirection = randomLightPath.normalized();
-	Ray shadowRay(intersection.impact + intersection.normal * EPSILON / 10, randomLightDirection);
-	IntersectResult shadowIntersect = intersect(shadowRay);
-	Vector directContribution;
-	if (!shadowIntersect.result || shadowIntersect.distance * shadowIntersect.distance > distance_2 - 100 * EPSILON) {
-		double px = std::max(1e-12, -lightDirection.dot(nPrime));
-		directContribution =
+	double px = std::max(1e-12, -lightDirection.dot(nPrime));
+	return {
+		.shadowRay = Ray(intersection.impact + intersection.normal * EPSILON / 10, randomLightDirection),
+		.distance = std::sqrt(distance_2 - 100 * EPSILON),
+		.contribution =
 			lightSource->lightPower / (4 * M_PI * M_PI) *
 			intersection.albedo *
 			std::max(0., intersection.normal.dot(randomLightDirection)) / px *
-			std::max(0., nPrime.dot(-randomLightDirection)) / distance_2;
-	}
-	Vector indirectContribution = getColor(Ray(intersection.impact + EPSILON * intersection.normal, cosRandomVector(intersection.normal)), maxBounce - 1, true) * intersection.albedo;
-	return indirectContribution + directContribution;
+			std::max(0., nPrime.dot(-randomLightDirection)) / distance_2
+	};
 }
 
+Ray Scene::diffuseRay(const IntersectResult& intersection) {
+	return {intersection.impact + EPSILON * intersection.normal, cosRandomVector(intersection.normal)};
+}
+
+Vector Camera::pixelPosition(int row, int column, const Config& config) {
+	return {column - static_cast<double>(config.width) / 2, -row + static_cast<double>(config.height) / 2, config.height / (2 * tan(config.alpha / 2))};
+}
+
+Ray Camera::sampleRay(const Vector& pixel, double focusDistance) const {
+	auto [dxPixel, dyPixel] = boxMuller(.5);
+	auto [dxCamera, dyCamera] = boxMuller(.5);
+	Vector u = (pixel + Vector(.5 + dxPixel, -.5 - dyPixel, 0) - origin).normalized();
+	u = u[0] * right + u[1] * up + u[2] * front;
+	Vector newOrigin = origin + Vector(dxCamera, dyCamera, 0);
+	Vector destination = origin + u / u.dot(front) * focusDistance;
+	Vector newDirection = destination - newOrigin;
+	return {newOrigin, newDirection.normalized()};
+}
+
+// With packets, the camera rays of a pixel are traced together up to their first hit, then each path goes on alone
 Vector Scene::getColor(const Camera& camera, const Vector& pixel, const Config& config) const {
 	Vector color;
-	for (int repeat = 0; repeat < config.raysPerPixel; repeat++) {
-		auto [dxPixel, dyPixel] = boxMuller(.5);
-		auto [dxCamera, dyCamera] = boxMuller(.5);
-		Vector u = (pixel + Vector(.5 + dxPixel, -.5 - dyPixel, 0) - camera.origin).normalized();
-		u = u[0] * camera.right + u[1] * camera.up + u[2] * camera.front;
-		Vector newOrigin = camera.origin + Vector(dxCamera, dyCamera, 0);
-		Vector destination = camera.origin + u / u.dot(camera.front) * config.focusDistance;
-		Vector newDirection = destination - newOrigin;
-		Ray ray(newOrigin, newDirection.normalized());
-		color += getColor(ray, config.maxBounce);
+	if (config.primaryRayPacketSize <= 1) {
+		for (int repeat = 0; repeat < config.raysPerPixel; repeat++) { color += getColor(camera.sampleRay(pixel, config.focusDistance), config.maxBounce); }
+		return color / config.raysPerPixel;
+	}
+	std::array<IntersectResult, RayPacket::MAX_SIZE> intersections;
+	for (int repeat = 0; repeat < config.raysPerPixel; repeat += config.primaryRayPacketSize) {
+		RayPacket packet;
+		for (int lane = 0; lane < config.primaryRayPacketSize && repeat + lane < config.raysPerPixel; lane++) { packet.add(camera.sampleRay(pixel, config.focusDistance)); }
+		intersect(packet, intersections);
+		for (uint32_t lane = 0; lane < packet.size; lane++) { color += shade(packet.ray(lane), intersections[lane], config.maxBounce); }
 	}
 	return color / config.raysPerPixel;
 }
 
-Vector Scene::bounceIntersection(const Ray& ray, const IntersectResult& intersection, int maxBounce) const {
+void Scene::sortPaths(std::vector<PathState>& paths, std::vector<PathState>& sorted) {
+	// 10 bits per axis for the origin cell, which keeps the sort to 5 passes
+	constexpr uint32_t ORIGIN_BITS = 30;
+	auto size = static_cast<uint32_t>(paths.size());
+	BoundingBox originBounds;
+	for (const PathState& path: paths) { originBounds.grow(path.origin); }
+	std::vector<uint64_t> codes(size);
+	std::vector<uint32_t> order(size);
+#pragma omp parallel for default(none) shared(paths, originBounds, codes, order, size)
+	for (uint32_t index = 0; index < size; index++) {
+		const Vector& direction = paths[index].direction;
+		uint64_t octant = (direction[0] < 0 ? 4u : 0u) | (direction[1] < 0 ? 2u : 0u) | (direction[2] < 0 ? 1u : 0u);
+		codes[index] = octant << ORIGIN_BITS | mortonCode(paths[index].origin, originBounds) >> (63 - ORIGIN_BITS);
+		order[index] = index;
+	}
+	radixSort(codes, order, ORIGIN_BITS + 3);
+	sorted.resize(size);
+#pragma omp parallel for default(none) shared(paths, sorted, order, size)
+	for (uint32_t index = 0; index < size; index++) { sorted[index] = paths[order[index]]; }
+	std::swap(paths, sorted);
+}
+
+void Scene::renderWavefront(const Camera& camera, const Config& config, uint32_t firstPixel, std::span<Vector> colors) const {
+	auto raysPerPixel = static_cast<uint32_t>(config.raysPerPixel);
+	std::vector<PathState> paths(colors.size() * raysPerPixel);
+#pragma omp parallel for default(none) schedule(static) shared(camera, config, firstPixel, colors, raysPerPixel, paths)
+	for (size_t pixel = 0; pixel < colors.size(); pixel++) {
+		auto index = static_cast<int>(firstPixel + pixel);
+		Vector position = Camera::pixelPosition(index / config.width, index % config.width, config);
+		for (uint32_t repeat = 0; repeat < raysPerPixel; repeat++) {
+			Ray ray = camera.sampleRay(position, config.focusDistance);
+			paths[pixel * raysPerPixel + repeat] = {.origin = ray.origin, .direction = ray.direction, .throughput = {1, 1, 1}, .pixel = static_cast<uint32_t>(pixel), .maxBounce = config.maxBounce};
+		}
+	}
+	std::ranges::fill(colors, Vector());
+
+	constexpr auto MATERIAL_COUNT = static_cast<uint32_t>(Material::Diffuse) + 1;
+	std::vector<IntersectResult> intersections;
+	std::vector<Material> materials;
+	std::vector<uint32_t> order;
+	std::vector<PathState> nextPaths;
+	std::vector<LightSample> shadowTests;
+	std::vector<Vector> radiances;
+	while (!paths.empty()) {
+		size_t pathCount = paths.size();
+		intersections.resize(pathCount);
+		materials.resize(pathCount);
+		order.resize(pathCount);
+		nextPaths.assign(pathCount, {});
+		shadowTests.resize(pathCount);
+		radiances.assign(pathCount, {});
+
+		// Extend: closest hit of every path
+#pragma omp parallel for default(none) schedule(dynamic, 256) shared(pathCount, paths, intersections, materials)
+		for (size_t index = 0; index < pathCount; index++) {
+			intersections[index] = intersect(Ray(paths[index].origin, paths[index].direction));
+			materials[index] = material(intersections[index]);
+		}
+
+		// Paths grouped by material so that each shading branch runs over a contiguous range
+		std::array<uint32_t, MATERIAL_COUNT + 1> materialStarts {};
+		for (Material pathMaterial: materials) { materialStarts[static_cast<uint32_t>(pathMaterial) + 1]++; }
+		for (uint32_t m = 0; m < MATERIAL_COUNT; m++) { materialStarts[m + 1] += materialStarts[m]; }
+		std::array<uint32_t, MATERIAL_COUNT> materialEnds {};
+		std::copy_n(materialStarts.begin(), MATERIAL_COUNT, materialEnds.begin());
+		for (uint32_t index = 0; index < pathCount; index++) { order[materialEnds[static_cast<uint32_t>(materials[index])]++] = index; }
+
+		// Shade: emission of the lights met, next ray of every path and light sample of the diffuse hits
+		uint32_t hitStart = materialStarts[static_cast<uint32_t>(Material::Miss) + 1];
+		uint32_t diffuseStart = materialStarts[static_cast<uint32_t>(Material::Diffuse)];
+#pragma omp parallel for default(none) schedule(dynamic, 256) shared(hitStart, pathCount, order, paths, intersections, materials, nextPaths, shadowTests, radiances)
+		for (size_t position = hitStart; position < pathCount; position++) {
+			uint32_t index = order[position];
+			const PathState& path = paths[index];
+			const IntersectResult& intersection = intersections[index];
+			Ray ray(path.origin, path.direction);
+			PathState& next = nextPaths[index];
+			switch (materials[index]) {
+				case Material::Light:
+					if (!path.isIndirect) { radiances[index] = path.throughput * lightEmission(); }
+					break;
+				case Material::Transparent: {
+					Ray transmitted = transmittedRay(ray, intersection);
+					next = {.origin = transmitted.origin, .direction = transmitted.direction, .throughput = path.throughput, .pixel = path.pixel, .maxBounce = path.maxBounce - 1};
+					break;
+				}
+				case Material::Mirror: {
+					Ray reflected = reflectedRay(ray, intersection);
+					next = {.origin = reflected.origin, .direction = reflected.direction, .throughput = path.throughput, .pixel = path.pixel, .maxBounce = path.maxBounce - 1};
+					break;
+				}
+				case Material::Diffuse: {
+					shadowTests[index] = sampleLight(intersection);
+					shadowTests[index].contribution = path.throughput * shadowTests[index].contribution;
+					Ray diffuse = diffuseRay(intersection);
+					next = {.origin = diffuse.origin, .direction = diffuse.direction, .throughput = path.throughput * intersection.albedo, .pixel = path.pixel, .maxBounce = path.maxBounce - 1, .isIndirect = true};
+					break;
+				}
+				default: // Miss
+					break;
+			}
+		}
+
+		// Shadow: direct lighting of the diffuse hits
+#pragma omp parallel for default(none) schedule(dynamic, 256) shared(diffuseStart, pathCount, order, shadowTests, radiances)
+		for (size_t position = diffuseStart; position < pathCount; position++) {
+			uint32_t index = order[position];
+			if (!occluded(shadowTests[index].shadowRay, shadowTests[index].distance)) { radiances[index] = shadowTests[index].contribution; }
+		}
+
+		size_t aliveCount = 0;
+		for (size_t index = 0; index < pathCount; index++) {
+			colors[paths[index].pixel] += radiances[index];
+			if (nextPaths[index].maxBounce >= 0) { nextPaths[aliveCount++] = nextPaths[index]; }
+		}
+		nextPaths.resize(aliveCount);
+		std::swap(paths, nextPaths);
+		if (config.secondaryRayOrder == RayOrder::Morton) { sortPaths(paths, nextPaths); }
+	}
+	for (Vector& color: colors) { color /= config.raysPerPixel; }
+}
+
+Ray Scene::reflectedRay(const Ray& ray, const IntersectResult& intersection) {
 	Vector direction = ray.direction - 2 * ray.direction.dot(intersection.normal) * intersection.normal;
-	Ray mirrorRay(intersection.impact + EPSILON * intersection.normal, direction);
-	return getColor(mirrorRay, maxBounce - 1);
+	return {intersection.impact + EPSILON * intersection.normal, direction};
 }
 
-Vector Scene::refractIntersection(const Ray& ray, const IntersectResult& intersection, int maxBounce) const {
+// Reflected or refracted ray leaving a transparent hit
+Ray Scene::transmittedRay(const Ray& ray, const IntersectResult& intersection) {
 	double incidentNormalComponent = ray.direction.dot(intersection.normal);
 	bool goingIn = incidentNormalComponent < 0;
 	char sign = goingIn ? 1 : -1;
@@ -154,15 +391,10 @@ Vector Scene::refractIntersection(const Ray& ray, const IntersectResult& interse
 	double indexRatio = n1 / n2;
 	double k0 = std::pow(n1 - n2, 2) / std::pow(n1 + n2, 2);
 	double reflection = k0 + (1 - k0) * std::pow(1 - std::abs(incidentNormalComponent), 5);
-	if (getRandomUniform() < reflection) {
-		return bounceIntersection(ray, intersection, maxBounce - 1);
-	}
+	if (getRandomUniform() < reflection) { return reflectedRay(ray, intersection); }
 	double normalSquared = 1 - std::pow(indexRatio, 2) * (1 - std::pow(incidentNormalComponent, 2));
-	if (normalSquared < 0) { return bounceIntersection(ray, intersection, maxBounce); }
+	if (normalSquared < 0) { return reflectedRay(ray, intersection); } // total internal reflection
 	Vector tangent = indexRatio * (ray.direction - sign * incidentNormalComponent * surfaceNormal);
 	Vector normal = -std::sqrt(normalSquared) * surfaceNormal;
-	Ray refractedRay(intersection.impact - EPSILON * surfaceNormal, normal + tangent);
-	return getColor(refractedRay, maxBounce);
+	return {intersection.impact - EPSILON * surfaceNormal, normal + tangent};
 }
-
-
@@ -6,9 +6,12 @@
 #define SCENE_H
 #include <array>
 #include <random>
+#include <span>
 #include <vector>
 
+#include "BoundingVolumeHierarchy.h"
 #include "Config.h"
+#include "Instance.h"
 #include "Sphere.h"
 #include "TriangleMesh.h"
 
@@ -22,6 +25,10 @@ struct Camera {
 	Vector right = front.cross(up);
 
 	void rotate(double angleRad, uint32_t axis);
+	// Position of the top left corner of a pixel on the image plane, in camera space
+	[[nodiscard]] static Vector pixelPosition(int row, int column, const Config& config);
+	// Ray through a random point of the pixel, from a random point of the lens focused at focusDistance
+	[[nodiscard]] Ray sampleRay(const Vector& pixel, double focusDistance) const;
 };
 
 class Scene {
@@ -38,16 +45,55 @@ public:
 	Scene();
 	void addSphere(const Sphere*);
 	void addMesh(const TriangleMesh*);
+	void addInstance(const Instance*);
+	// Builds the top-level BVH over the objects bounds, must be called once all objects are added and again after any of them moved.
+	// When no object was added since the last call, the tree is only refitted, unless this degrades it too much.
+	void buildBvh();
 	[[nodiscard]] IntersectResult intersect(const Ray& ray) const;
+	// Closest hit of each lane, tracing the lanes together through the scene and mesh BVHs
+	void intersect(RayPacket& packet, std::array<IntersectResult, RayPacket::MAX_SIZE>& intersections) const;
+	[[nodiscard]] bool occluded(const Ray& ray, double tMax) const;
 	[[nodiscard]] Vector getColor(const Ray& ray, int maxBounce, bool isIndirect = false) const;
 	[[nodiscard]] Vector getColor(const Camera& camera, const Vector& pixel, const Config& config) const;
+	// Colors of the pixels firstPixel to firstPixel + colors.size() of the image, in row order. All the paths of the pixels
+	// go through each bounce together: they are extended, shaded grouped by material, then their shadow rays are tested.
+	void renderWavefront(const Camera& camera, const Config& config, uint32_t firstPixel, std::span<Vector> colors) const;
+
+	static constexpr uint32_t WAVEFRONT_SIZE = 1 << 18; // paths a renderWavefront batch should hold
 
 	std::vector<const Object*> objects;
 	const Sphere* lightSource = nullptr;
+	BoundingVolumeHierarchy bvh;
+	std::vector<const Object*> bvhObjects; // objects in the order of the BVH leaves
 
 private:
-	[[nodiscard]] Vector bounceIntersection(const Ray& ray, const IntersectResult& intersection, int maxBounce) const;
-	[[nodiscard]] Vector refractIntersection(const Ray& ray, const IntersectResult& intersection, int maxBounce) const;
+	enum class Material : uint8_t { Miss, Light, Transparent, Mirror, Diffuse };
+
+	// Path of the wavefront integrator waiting for its next ray to be traced
+	struct PathState {
+		Vector origin;
+		Vector direction;
+		Vector throughput; // product of the albedos met so far
+		uint32_t pixel = 0;
+		int maxBounce = -1; // terminated when negative
+		bool isIndirect = false;
+	};
+
+	struct LightSample {
+		Ray shadowRay {{}, {}};
+		double distance = 0; // up to the sampled point of the light
+		Vector contribution; // brought by the light when nothing blocks the shadow ray
+	};
+
+	[[nodiscard]] Vector shade(const Ray& ray, const IntersectResult& intersection, int maxBounce, bool isIndirect = false) const;
+	[[nodiscard]] static Material material(const IntersectResult& intersection);
+	// Sorts the paths by the direction octant then the Morton code of the origin of their rays, sorted is used as scratch space
+	static void sortPaths(std::vector<PathState>& paths, std::vector<PathState>& sorted);
+	[[nodiscard]] double lightEmission() const;
+	[[nodiscard]] LightSample sampleLight(const IntersectResult& intersection) const;
+	[[nodiscard]] static Ray diffuseRay(const IntersectResult& intersection);
+	[[nodiscard]] static Ray reflectedRay(const Ray& ray, const IntersectResult& intersection);
+	[[nodiscard]] static Ray transmittedRay(const Ray& ray, const IntersectResult& intersection);
 };
 
 
@@ -11,7 +11,7 @@
 Sphere::Sphere(const Vector& center, double radius, const Vector& albedo): Object(albedo), center(center), radius(radius) {}
 Sphere::Sphere(const Vector& center, double radius, const AlbedoFunction& albedo): Object(albedo), center(center), radius(radius) {}
 
-Object::IntersectResult Sphere::intersect(const Ray& ray) const {
+Object::Hit Sphere::closestHit(const Ray& ray, double tMax) const {
 	double a = 1;
 	double b = 2 * ray.direction.dot(ray.origin - center);
 	double c = (ray.origin - center).norm2() - radius * radius;
@@ -22,10 +22,23 @@ Object::IntersectResult Sphere::intersect(const Ray& ray) const {
 	double t2 = (-b + sqrt_delta) / 2;
 	if (t2 < 0) { return {}; }
 	double t = t1 > 0 ? t1 : t2;
-	Vector impact = ray.origin + t * ray.direction;
+	if (t >= tMax) { return {}; }
+	return {.distance = t, .primitive = 0, .beta = 0, .gamma = 0, .result = true};
+}
+
+Object::IntersectResult Sphere::hitAttributes(const Ray& ray, const Hit& hit) const {
+	Vector impact = ray.origin + hit.distance * ray.direction;
 	Vector normal = impact - center;
 	Vector albedo = hasVariableAlbedo ? albedoFunction(impact) : this->albedo;
-	return {.impact = impact, .normal = normal.normalized(), .distance = t, .albedo = albedo, .result = true};
+	return {.impact = impact, .normal = normal.normalized(), .distance = hit.distance, .albedo = albedo, .result = true};
+}
+
+bool Sphere::occluded(const Ray& ray, double tMax) const {
+	return closestHit(ray, tMax).result;
+}
+
+BoundingBox Sphere::boundingBox() const {
+	return {.min = center - radius * vec111, .max = center + radius * vec111};
 }
 
 Sphere& Sphere::mirror() {
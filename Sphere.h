@@ -14,7 +14,10 @@ class Sphere: public Object {
 public:
 	Sphere(const Vector& center, double radius, const Vector& albedo);
 	Sphere(const Vector& center, double radius, const AlbedoFunction& albedo);
-	[[nodiscard]] IntersectResult intersect(const Ray& ray) const override;
+	[[nodiscard]] Hit closestHit(const Ray& ray, double tMax) const override;
+	[[nodiscard]] IntersectResult hitAttributes(const Ray& ray, const Hit& hit) const override;
+	[[nodiscard]] bool occluded(const Ray& ray, double tMax) const override;
+	[[nodiscard]] BoundingBox boundingBox() const override;
 
 	Sphere& mirror();
 	Sphere& transparent(double opticalIndex);
@@ -2,22 +2,39 @@
 
 #include <algorithm>
 #include <array>
+#include <bit>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <limits>
-#include <stack>
+#include <random>
 #include <string>
 
 #include "stb_image.h"
 
+// To be increased whenever the cache layout or the build algorithms change
+constexpr uint32_t BVH_CACHE_VERSION = 3;
+constexpr std::array<char, 4> BVH_CACHE_MAGIC {'B', 'V', 'H', 'C'};
+
+// The cache file is this header, followed by the nodes and the source index of each ordered triangle
+struct BvhCacheHeader {
+	std::array<char, 4> magic;
+	uint32_t version;
+	uint64_t key;
+	uint64_t nodeCount;
+	uint64_t triangleCount;
+	double builtSahCost;
+};
+
 TriangleMesh::TriangleMesh(const Vector& albedo): Object(albedo) {}
-TriangleMesh::~TriangleMesh() { delete rootBvh; }
 
 // Adapted from https://pastebin.com/CAgp9r15
 void TriangleMesh::readOBJ(const char* obj) {
 	std::ifstream stream(obj);
+	bvhCacheFile = std::string(obj) + ".bvh";
 	std::string line;
 	uint32_t curGroup = UINT_MAX;
 	while (std::getline(stream, line)) {
@@ -49,21 +66,22 @@ void TriangleMesh::readOBJ(const char* obj) {
 			uvs.push_back(vec);
 		} else if (line[0] == 'f') {
 			TriangleIndices triangle;
+			TriangleAttributes attributes;
 			uint32_t i0, i1, i2;
 			uint32_t j0, j1, j2;
 			uint32_t k0, k1, k2;
-			triangle.group = curGroup;
+			attributes.group = curGroup;
 			int offset;
 			int read = sscanf(line.c_str(), "f %u/%u/%u %u/%u/%u %u/%u/%u%n", &i0, &j0, &k0, &i1, &j1, &k1, &i2, &j2, &k2, &offset);
 			if (read == 9) {
 				triangle.vertexIndices = {i0 - 1, i1 - 1, i2 - 1};
-				triangle.colorIndices = {j0 - 1, j1 - 1, j2 - 1};
-				triangle.normalIndices = {k0 - 1, k1 - 1, k2 - 1};
+				attributes.colorIndices = {j0 - 1, j1 - 1, j2 - 1};
+				attributes.normalIndices = {k0 - 1, k1 - 1, k2 - 1};
 			} else {
 				read = sscanf(line.c_str(), "f %u/%u %u/%u %u/%u%n", &i0, &j0, &i1, &j1, &i2, &j2, &offset);
 				if (read == 6) {
 					triangle.vertexIndices = {i0 - 1, i1 - 1, i2 - 1};
-					triangle.colorIndices = {j0 - 1, j1 - 1, j2 - 1};
+					attributes.colorIndices = {j0 - 1, j1 - 1, j2 - 1};
 				} else {
 					read = sscanf(line.c_str(), "f %u %u %u%n", &i0, &i1, &i2, &offset);
 					if (read == 3) {
@@ -74,6 +92,7 @@ void TriangleMesh::readOBJ(const char* obj) {
 				}
 			}
 			triangles.push_back(triangle);
+			triangleAttributes.push_back(attributes);
 		}
 	}
 	stream.close();
@@ -89,149 +108,475 @@ void TriangleMesh::loadTexture(const char* fileName) {
 	stbi_image_free(textureData);
 }
 
-void TriangleMesh::computeTriangleBarycenters() {
-	for (TriangleIndices& triangle: triangles) {
-		triangle.barycenter = (vertices[triangle.vertexIndices[0]] + vertices[triangle.vertexIndices[1]] + vertices[triangle.vertexIndices[2]]) / 3;
+std::vector<Vector> TriangleMesh::computeTriangleCentroids() const {
+	std::vector<Vector> centroids(triangles.size());
+#pragma omp parallel for default(none) shared(centroids)
+	for (uint32_t index = 0; index < triangles.size(); index++) {
+		const std::array<uint32_t, 3>& vertexIndices = triangles[index].vertexIndices;
+		centroids[index] = (vertices[vertexIndices[0]] + vertices[vertexIndices[1]] + vertices[vertexIndices[2]]) / 3;
 	}
+	return centroids;
 }
 
-BoundingBox::IntersectResult BoundingBox::intersect(const Ray& ray) const {
-	std::array<double, 3> minT {};
-	std::array<double, 3> maxT {};
-	Vector om = min - ray.origin;
-	Vector oM = max - ray.origin;
-	for (uint32_t i = 0; i < 3; i++) {
-		double inter1 = om[i] / ray.direction[i];
-		double inter2 = oM[i] / ray.direction[i];
-		minT[i] = std::min(inter1, inter2);
-		maxT[i] = std::max(inter1, inter2);
+// Lanes of packet among the lanes firstLane to lastLane (excluded) counted over all the packets
+template<typename Real>
+static uint32_t packetLanes(uint32_t packet, uint32_t firstLane, uint32_t lastLane) {
+	constexpr uint32_t WIDTH = TrianglePacket<Real>::WIDTH;
+	uint32_t first = std::max(firstLane, packet * WIDTH) - packet * WIDTH;
+	uint32_t last = std::min(lastLane, (packet + 1) * WIDTH) - packet * WIDTH;
+	return ((1u << last) - 1) & ~((1u << first) - 1);
+}
+
+// On equal distances the later triangle wins, as when they were tested one by one
+template<typename Real>
+static Object::Hit closestPacketHit(const std::vector<TrianglePacket<Real>>& packets, const Ray& ray, uint32_t firstLane, uint32_t lastLane, double tMax) {
+	constexpr uint32_t WIDTH = TrianglePacket<Real>::WIDTH;
+	Object::Hit best {.distance = tMax, .primitive = 0, .beta = 0, .gamma = 0, .result = false};
+	for (uint32_t packetIndex = firstLane / WIDTH; packetIndex * WIDTH < lastLane; ++packetIndex) {
+		const TrianglePacket<Real>& packet = packets[packetIndex];
+		std::array<Real, WIDTH> t, beta, gamma;
+		uint32_t lanes = packetLanes<Real>(packetIndex, firstLane, lastLane);
+		for (uint32_t hits = packet.intersect(ray, best.distance, t, beta, gamma) & lanes; hits != 0; hits &= hits - 1) {
+			auto lane = static_cast<uint32_t>(std::countr_zero(hits));
+			if (t[lane] > best.distance) { continue; }
+			best = {.distance = t[lane], .primitive = packet.index[lane], .beta = beta[lane], .gamma = gamma[lane], .result = true};
+		}
 	}
-	double minOfMax = std::min(maxT[0], std::min(maxT[1], maxT[2]));
-	double maxOfMin = std::max(minT[0], std::max(minT[1], minT[2]));
-	return {maxOfMin, minOfMax > 0 && minOfMax > maxOfMin};
+	return best;
 }
 
-Vector BoundingBox::extent() const {
-	return max - min;
+template<typename Real>
+static bool occludedPackets(const std::vector<TrianglePacket<Real>>& packets, const Ray& ray, uint32_t firstLane, uint32_t lastLane, double tMax) {
+	constexpr uint32_t WIDTH = TrianglePacket<Real>::WIDTH;
+	for (uint32_t packetIndex = firstLane / WIDTH; packetIndex * WIDTH < lastLane; ++packetIndex) {
+		std::array<Real, WIDTH> t, beta, gamma;
+		uint32_t lanes = packetLanes<Real>(packetIndex, firstLane, lastLane);
+		for (uint32_t hits = packets[packetIndex].intersect(ray, tMax, t, beta, gamma) & lanes; hits != 0; hits &= hits - 1) {
+			if (t[static_cast<uint32_t>(std::countr_zero(hits))] < tMax) { return true; }
+		}
+	}
+	return false;
 }
 
-BoundingVolumeHierarchy::BoundingVolumeHierarchy(uint32_t start, uint32_t end, const TriangleMesh& mesh): rangeStart(start), rangeEnd(end), mesh(mesh) {}
-BoundingVolumeHierarchy::~BoundingVolumeHierarchy() {
-	delete leftChild;
-	delete rightChild;
+Object::Hit TriangleMesh::intersectTriangles(const Ray& ray, uint32_t start, uint32_t end, double tMax) const {
+	uint32_t firstLane = triangleLanes[start];
+	uint32_t lastLane = firstLane + end - start;
+	if (precision == GeometryPrecision::Float) { return closestPacketHit(floatTrianglePackets, ray, firstLane, lastLane, tMax); }
+	return closestPacketHit(trianglePackets, ray, firstLane, lastLane, tMax);
 }
 
-void BoundingVolumeHierarchy::buildBoundingBox() {
-	Vector min = std::numeric_limits<double>::infinity() * vec111;
-	Vector max = -min;
-	for (uint32_t triangle = rangeStart; triangle < rangeEnd; triangle++) {
-		for (const uint32_t& vertex: mesh.triangles[triangle].vertexIndices) {
-			for (uint32_t i = 0; i < 3; i++) {
-				const Vector& coordinates = mesh.vertices[vertex];
-				if (coordinates[i] > max[i]) { max[i] = coordinates[i]; }
-				if (coordinates[i] < min[i]) { min[i] = coordinates[i]; }
-			}
+// Single precision hits are refined in double precision from the vertices, once for the closest hit of the ray:
+// the impact is put back on the plane of the triangle and the barycentric coordinates inside it.
+Object::Hit TriangleMesh::refineHit(const Ray& ray, const Hit& hit) const {
+	const std::array<uint32_t, 3>& vertexIndices = triangles[hit.primitive].vertexIndices;
+	const Vector& v0 = vertices[vertexIndices[0]];
+	Vector e1 = vertices[vertexIndices[1]] - v0;
+	Vector e2 = vertices[vertexIndices[2]] - v0;
+	double t, beta, gamma;
+	intersectTrianglePlane(ray, v0, e1, e2, e1.cross(e2), t, beta, gamma);
+	// a ray grazing the plane keeps its single precision hit
+	if (!std::isfinite(t) || !std::isfinite(beta) || !std::isfinite(gamma)) { return hit; }
+	beta = std::clamp(beta, 0., 1.);
+	gamma = std::clamp(gamma, 0., 1 - beta);
+	return {.distance = t, .primitive = hit.primitive, .beta = beta, .gamma = gamma, .result = true};
+}
+
+Object::IntersectResult TriangleMesh::hitAttributes(const Ray& ray, const Hit& closest) const {
+	Hit hit = precision == GeometryPrecision::Float ? refineHit(ray, closest) : closest;
+	double alpha = 1 - hit.beta - hit.gamma;
+	const TriangleAttributes& triangle = triangleAttributes[hit.primitive];
+	Vector correctedNormal = normals[triangle.normalIndices[0]] * alpha + normals[triangle.normalIndices[1]] * hit.beta + normals[triangle.normalIndices[2]] * hit.gamma;
+	Vector albedo;
+	if (!textures.empty()) {
+		Vector colorPosition = uvs[triangle.colorIndices[0]] * alpha + uvs[triangle.colorIndices[1]] * hit.beta + uvs[triangle.colorIndices[2]] * hit.gamma;
+		const Texture& texture = textures[triangle.group];
+		uint32_t colorU = std::fmod(colorPosition[0] + 1000, 1) * texture.width;
+		uint32_t colorV = (1 - std::fmod(colorPosition[1] + 1000, 1)) * texture.height;
+		uint32_t indexInTexture = 3 * (colorV * texture.width + colorU);
+		albedo = Vector(texture.data[indexInTexture], texture.data[indexInTexture + 1], texture.data[indexInTexture + 2]);
+	}
+	return {.impact = ray.origin + hit.distance * ray.direction, .normal = correctedNormal, .distance = hit.distance, .albedo = albedo, .result = true};
+}
+
+bool TriangleMesh::occludedTriangles(const Ray& ray, uint32_t start, uint32_t end, double tMax) const {
+	uint32_t firstLane = triangleLanes[start];
+	uint32_t lastLane = firstLane + end - start;
+	if (precision == GeometryPrecision::Float) { return occludedPackets(floatTrianglePackets, ray, firstLane, lastLane, tMax); }
+	return occludedPackets(trianglePackets, ray, firstLane, lastLane, tMax);
+}
+
+bool TriangleMesh::buildBvh(const BvhBuildOptions& options) {
+	restoreSourceTriangles();
+	bvhOptions = options;
+	bvhLayout = options.layout;
+	uint64_t cacheKey = bvhCacheKey();
+	bool cached = !bvhCacheFile.empty() && loadBvhCache(cacheKey);
+	if (!cached) {
+		buildBinaryBvh();
+		if (!bvhCacheFile.empty()) { saveBvhCache(cacheKey); }
+	}
+	collapseBvh();
+	return cached;
+}
+
+void TriangleMesh::buildBinaryBvh() {
+	restoreSourceTriangles();
+	PrimitiveClipper clipper = [this](uint32_t index, uint32_t axis, double min, double max) { return clipTriangle(index, axis, min, max); };
+	std::vector<uint32_t> order = bvh.build(computeTriangleBounds(), computeTriangleCentroids(), bvhOptions, clipper);
+	gatherTriangles(order);
+	triangleSources = std::move(order);
+}
+
+bool TriangleMesh::refitBvh() {
+	if (bvh.nodes.empty()) { return false; }
+	bvh.refit(computeTriangleBounds());
+	if (bvh.sahCost() > bvhOptions.refitRebuildRatio * bvh.builtSahCost) {
+		buildBinaryBvh();
+		collapseBvh();
+		return true;
+	}
+	collapseBvh();
+	return false;
+}
+
+// FNV-1a
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size) {
+	const auto* bytes = static_cast<const uint8_t*>(data);
+	for (size_t index = 0; index < size; index++) { hash = (hash ^ bytes[index]) * 0x100000001b3; }
+	return hash;
+}
+
+// Hash of everything the built tree depends on: transformed vertices, faces and build parameters.
+// Must be called with the triangles in file order.
+uint64_t TriangleMesh::bvhCacheKey() const {
+	uint64_t hash = 0xcbf29ce484222325;
+	hash = hashBytes(hash, &BVH_CACHE_VERSION, sizeof(BVH_CACHE_VERSION));
+	hash = hashBytes(hash, &bvhOptions.builder, sizeof(bvhOptions.builder));
+	hash = hashBytes(hash, &bvhOptions.maxLeafSize, sizeof(bvhOptions.maxLeafSize));
+	hash = hashBytes(hash, &bvhOptions.traversalCost, sizeof(bvhOptions.traversalCost));
+	hash = hashBytes(hash, &bvhOptions.intersectionCost, sizeof(bvhOptions.intersectionCost));
+	hash = hashBytes(hash, &bvhOptions.binCount, sizeof(bvhOptions.binCount));
+	hash = hashBytes(hash, &bvhOptions.spatialSplitBudget, sizeof(bvhOptions.spatialSplitBudget));
+	hash = hashBytes(hash, vertices.data(), vertices.size() * sizeof(Vector));
+	for (const TriangleIndices& triangle: triangles) { hash = hashBytes(hash, triangle.vertexIndices.data(), sizeof(triangle.vertexIndices)); }
+	return hash;
+}
+
+// Reads the whole file at once. Returns false, leaving the mesh untouched, if the file is missing, stale, truncated or corrupted.
+// Must be called with the triangles in file order, which the stored sources then reorder.
+bool TriangleMesh::loadBvhCache(uint64_t key) {
+	std::ifstream stream(bvhCacheFile, std::ios::binary | std::ios::ate);
+	if (!stream) { return false; }
+	auto size = static_cast<size_t>(stream.tellg());
+	if (size < sizeof(BvhCacheHeader)) { return false; }
+	std::vector<char> data(size);
+	stream.seekg(0);
+	if (!stream.read(data.data(), static_cast<std::streamsize>(size))) { return false; }
+	BvhCacheHeader header {};
+	std::memcpy(&header, data.data(), sizeof(header));
+	if (header.magic != BVH_CACHE_MAGIC || header.version != BVH_CACHE_VERSION || header.key != key) { return false; }
+	size_t nodesSize = header.nodeCount * sizeof(BvhNode);
+	size_t sourcesSize = header.triangleCount * sizeof(uint32_t);
+	if (size != sizeof(header) + nodesSize + sourcesSize) { return false; }
+	std::vector<uint32_t> sources(header.triangleCount);
+	std::memcpy(sources.data(), data.data() + sizeof(header) + nodesSize, sourcesSize);
+	if (!sources.empty() && *std::ranges::max_element(sources) >= triangles.size()) { return false; }
+	BoundingVolumeHierarchy loaded;
+	loaded.nodes.resize(header.nodeCount);
+	std::memcpy(loaded.nodes.data(), data.data() + sizeof(header), nodesSize);
+	if (!loaded.valid(sources.size())) { return false; }
+	bvh.nodes = std::move(loaded.nodes);
+	gatherTriangles(sources);
+	triangleSources = std::move(sources);
+	bvh.builtSahCost = header.builtSahCost;
+	return true;
+}
+
+// Written to a temporary file of its own first, so that a concurrent render never reads a partial cache nor writes the same temporary file
+void TriangleMesh::saveBvhCache(uint64_t key) const {
+	BvhCacheHeader header {
+		.magic = BVH_CACHE_MAGIC,
+		.version = BVH_CACHE_VERSION,
+		.key = key,
+		.nodeCount = bvh.nodes.size(),
+		.triangleCount = triangles.size(),
+		.builtSahCost = bvh.builtSahCost
+	};
+	std::string temporaryFile = bvhCacheFile + "." + std::to_string(std::random_device {}()) + ".tmp";
+	std::error_code error;
+	{
+		std::ofstream stream(temporaryFile, std::ios::binary | std::ios::trunc);
+		stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		stream.write(reinterpret_cast<const char*>(bvh.nodes.data()), static_cast<std::streamsize>(bvh.nodes.size() * sizeof(BvhNode)));
+		stream.write(reinterpret_cast<const char*>(triangleSources.data()), static_cast<std::streamsize>(triangleSources.size() * sizeof(uint32_t)));
+		if (!stream) { error = std::make_error_code(std::errc::io_error); }
+	}
+	if (!error) { std::filesystem::rename(temporaryFile, bvhCacheFile, error); }
+	if (error) {
+		std::cerr << "Warning: unable to write BVH cache '" << bvhCacheFile << "'\n";
+		std::filesystem::remove(temporaryFile, error);
+	}
+}
+
+std::vector<BoundingBox> TriangleMesh::computeTriangleBounds() const {
+	std::vector<BoundingBox> triangleBounds(triangles.size());
+#pragma omp parallel for default(none) shared(triangleBounds)
+	for (uint32_t index = 0; index < triangles.size(); index++) {
+		for (const uint32_t& vertex: triangles[index].vertexIndices) { triangleBounds[index].grow(vertices[vertex]); }
+	}
+	return triangleBounds;
+}
+
+// Bounds of the part of the triangle lying between the planes min and max along axis
+BoundingBox TriangleMesh::clipTriangle(uint32_t index, uint32_t axis, double min, double max) const {
+	BoundingBox box;
+	const std::array<uint32_t, 3>& vertexIndices = triangles[index].vertexIndices;
+	for (uint32_t corner = 0; corner < 3; corner++) {
+		const Vector& a = vertices[vertexIndices[corner]];
+		const Vector& b = vertices[vertexIndices[(corner + 1) % 3]];
+		if (a[axis] >= min && a[axis] <= max) { box.grow(a); }
+		for (double plane: {min, max}) {
+			if ((a[axis] < plane) == (b[axis] < plane)) { continue; }
+			Vector crossing = a + (plane - a[axis]) / (b[axis] - a[axis]) * (b - a);
+			crossing[axis] = plane;
+			box.grow(crossing);
 		}
 	}
-	boundingBox.min = min;
-	boundingBox.max = max;
-}
-
-Object::IntersectResult BoundingVolumeHierarchy::intersect(const Ray& ray) const {
-	bool hasInter = false;
-	double bestT = std::numeric_limits<double>::infinity();
-	Vector bestNormal;
-	Vector bestImpact;
-	Vector bestAlbedo;
-	for (uint32_t index = rangeStart; index < rangeEnd; ++index) {
-		const TriangleIndices& triangle = mesh.triangles[index];
-		const Vector& a = mesh.vertices[triangle.vertexIndices[0]];
-		const Vector& b = mesh.vertices[triangle.vertexIndices[1]];
-		const Vector& c = mesh.vertices[triangle.vertexIndices[2]];
-		Vector e1 = b - a;
-		Vector e2 = c - a;
-		Vector ao = ray.origin - a;
-		Vector aoCrossU = ao.cross(ray.direction);
-		Vector normal = e1.cross(e2);
-		double invDet = 1. / ray.direction.dot(normal);
-		double beta = -e2.dot(aoCrossU) * invDet;
-		if (beta < 0 || beta > 1) { continue; }
-		double gamma = e1.dot(aoCrossU) * invDet;
-		if (gamma < 0 || gamma > 1) { continue; }
-		double alpha = 1 - beta - gamma;
-		if (alpha < 0) { continue; }
-		double t = -ao.dot(normal) * invDet;
-		if (t < 0 || t > bestT) { continue; }
-		Vector correctedNormal = mesh.normals[triangle.normalIndices[0]] * alpha + mesh.normals[triangle.normalIndices[1]] * beta + mesh.normals[triangle.normalIndices[2]] * gamma;
-		if (!mesh.textures.empty()) {
-			Vector colorPosition = mesh.uvs[triangle.colorIndices[0]] * alpha + mesh.uvs[triangle.colorIndices[1]] * beta + mesh.uvs[triangle.colorIndices[2]] * gamma;
-			const TriangleMesh::Texture& texture = mesh.textures[triangle.group];
-			uint32_t colorU = std::fmod(colorPosition[0] + 1000, 1) * texture.width;
-			uint32_t colorV = (1 - std::fmod(colorPosition[1] + 1000, 1)) * texture.height;
-			uint32_t indexInTexture = 3 * (colorV * texture.width + colorU);
-			bestAlbedo = Vector(texture.data[indexInTexture], texture.data[indexInTexture + 1], texture.data[indexInTexture + 2]);
-		} else {
-			bestAlbedo = {};
+	return box;
+}
+
+// Puts the triangles back in file order, dropping the duplicates added by spatial splits, before building a new BVH
+void TriangleMesh::restoreSourceTriangles() {
+	if (triangleSources.empty()) { return; }
+	std::vector<TriangleIndices> sourceTriangles(*std::ranges::max_element(triangleSources) + 1);
+	std::vector<TriangleAttributes> sourceAttributes(sourceTriangles.size());
+	for (uint32_t index = 0; index < triangles.size(); index++) {
+		sourceTriangles[triangleSources[index]] = triangles[index];
+		sourceAttributes[triangleSources[index]] = triangleAttributes[index];
+	}
+	triangles = std::move(sourceTriangles);
+	triangleAttributes = std::move(sourceAttributes);
+	triangleSources.clear();
+}
+
+void TriangleMesh::gatherTriangles(const std::vector<uint32_t>& order) {
+	std::vector<TriangleIndices> orderedTriangles(order.size());
+	std::vector<TriangleAttributes> orderedAttributes(order.size());
+#pragma omp parallel for default(none) shared(order, orderedTriangles, orderedAttributes)
+	for (uint32_t index = 0; index < order.size(); index++) {
+		orderedTriangles[index] = triangles[order[index]];
+		orderedAttributes[index] = triangleAttributes[order[index]];
+	}
+	triangles = std::move(orderedTriangles);
+	triangleAttributes = std::move(orderedAttributes);
+}
+
+void TriangleMesh::collapseBvh() {
+	bvh4.nodes.clear();
+	bvh8.nodes.clear();
+	compressedBvh4.nodes.clear();
+	compressedBvh8.nodes.clear();
+	std::vector<uint32_t> primitiveOrder;
+	switch (bvhLayout) {
+		case BvhLayout::Wide4:
+			bvh4.collapse(bvh);
+			primitiveOrder = bvh4.reorder(bvhOptions.nodeOrder);
+			break;
+		case BvhLayout::Wide8:
+			bvh8.collapse(bvh);
+			primitiveOrder = bvh8.reorder(bvhOptions.nodeOrder);
+			break;
+		case BvhLayout::Compressed4:
+			compressedBvh4.collapse(bvh);
+			primitiveOrder = compressedBvh4.reorder(bvhOptions.nodeOrder);
+			break;
+		case BvhLayout::Compressed8:
+			compressedBvh8.collapse(bvh);
+			primitiveOrder = compressedBvh8.reorder(bvhOptions.nodeOrder);
+			break;
+		default:
+			break;
+	}
+	if (!primitiveOrder.empty()) { applyPrimitiveOrder(primitiveOrder); }
+	computeTrianglePackets();
+}
+
+// Packs the triangles of the leaves one after the other, so that small leaves share packets
+void TriangleMesh::computeTrianglePackets() {
+	std::vector<std::pair<uint32_t, uint32_t>> leaves;
+	for (const BvhNode& node: bvh.nodes) {
+		if (node.isLeaf()) { leaves.emplace_back(node.offset, node.primitiveCount); }
+	}
+	std::ranges::sort(leaves);
+	triangleLanes.assign(triangles.size(), 0);
+	trianglePackets.clear();
+	floatTrianglePackets.clear();
+	if (precision == GeometryPrecision::Float) {
+		packLeaves(leaves, floatTrianglePackets);
+	} else {
+		packLeaves(leaves, trianglePackets);
+	}
+	trianglePackets.shrink_to_fit();
+	floatTrianglePackets.shrink_to_fit();
+}
+
+template<typename Real>
+void TriangleMesh::packLeaves(const std::vector<std::pair<uint32_t, uint32_t>>& leaves, std::vector<TrianglePacket<Real>>& packets) {
+	constexpr uint32_t WIDTH = TrianglePacket<Real>::WIDTH;
+	uint32_t lane = 0;
+	for (auto [start, count]: leaves) {
+		// a leaf which fits in one packet is not split across two, larger ones start a packet
+		if (lane % WIDTH != 0 && lane % WIDTH + count > WIDTH) { lane += WIDTH - lane % WIDTH; }
+		for (uint32_t index = 0; index < count; index++, lane++) {
+			if (lane % WIDTH == 0) { packets.emplace_back(); }
+			triangleLanes[start + index] = lane;
+			const std::array<uint32_t, 3>& vertexIndices = triangles[start + index].vertexIndices;
+			packets.back().set(lane % WIDTH, start + index, vertices[vertexIndices[0]], vertices[vertexIndices[1]], vertices[vertexIndices[2]]);
 		}
-		hasInter = true;
-		bestT = t;
-		bestImpact = ray.origin + t * ray.direction;
-		bestNormal = correctedNormal;
 	}
-	return {.impact = bestImpact, .normal = bestNormal, .distance = bestT, .albedo = bestAlbedo, .result = hasInter};
 }
 
-void TriangleMesh::buildBvh() {
-	computeTriangleBarycenters();
-	rootBvh = new BoundingVolumeHierarchy(0, triangles.size(), *this);
-	buildBvh(rootBvh);
+// Moves the triangles to the order chosen by the wide layout, the leaves of the binary tree follow their range
+void TriangleMesh::applyPrimitiveOrder(const std::vector<uint32_t>& primitiveOrder) {
+	gatherTriangles(primitiveOrder);
+	std::vector<uint32_t> orderedSources(triangleSources.size());
+	std::vector<uint32_t> newIndices(triangles.size());
+	for (uint32_t index = 0; index < primitiveOrder.size(); index++) {
+		orderedSources[index] = triangleSources[primitiveOrder[index]];
+		newIndices[primitiveOrder[index]] = index;
+	}
+	triangleSources = std::move(orderedSources);
+	for (BvhNode& node: bvh.nodes) {
+		if (node.isLeaf()) { node.offset = newIndices[node.offset]; }
+	}
+}
+
+size_t TriangleMesh::triangleByteSize() const {
+	return triangles.size() * sizeof(TriangleIndices) + triangleAttributes.size() * sizeof(TriangleAttributes) + triangleSources.size() * sizeof(uint32_t) +
+	       trianglePackets.size() * sizeof(TrianglePacket<double>) + floatTrianglePackets.size() * sizeof(TrianglePacket<float>) + triangleLanes.size() * sizeof(uint32_t);
 }
 
-void TriangleMesh::buildBvh(BoundingVolumeHierarchy* bvh) {
-	bvh->buildBoundingBox();
-	if (bvh->rangeEnd - bvh->rangeStart <= 4) { return; }
-	std::array<double, 3> extent = bvh->boundingBox.extent().getCoordinates();
-	long longestDirection = std::distance(extent.begin(), std::ranges::max_element(extent));
-	double limit = (bvh->boundingBox.max[longestDirection] + bvh->boundingBox.min[longestDirection]) / 2;
-	auto pivot = std::partition(triangles.begin() + bvh->rangeStart, triangles.begin() + bvh->rangeEnd, [longestDirection, limit](const TriangleIndices& triangle) { return triangle.barycenter[longestDirection] <= limit; });
-	long pivotIndex = std::distance(triangles.begin(), pivot);
-	if (pivotIndex == bvh->rangeStart || pivotIndex == bvh->rangeEnd) { return; }
-	auto* left = new BoundingVolumeHierarchy(bvh->rangeStart, pivotIndex, *this);
-	auto* right = new BoundingVolumeHierarchy(pivotIndex, bvh->rangeEnd, *this);
-	bvh->leftChild = left;
-	bvh->rightChild = right;
-	buildBvh(left);
-	buildBvh(right);
+size_t TriangleMesh::bvhNodeCount() const {
+	switch (bvhLayout) {
+		case BvhLayout::Wide4:
+			return bvh4.nodes.size();
+		case BvhLayout::Wide8:
+			return bvh8.nodes.size();
+		case BvhLayout::Compressed4:
+			return compressedBvh4.nodes.size();
+		case BvhLayout::Compressed8:
+			return compressedBvh8.nodes.size();
+		default:
+			return bvh.nodes.size();
+	}
+}
+
+size_t TriangleMesh::bvhByteSize() const {
+	switch (bvhLayout) {
+		case BvhLayout::Wide4:
+			return bvh4.byteSize();
+		case BvhLayout::Wide8:
+			return bvh8.byteSize();
+		case BvhLayout::Compressed4:
+			return compressedBvh4.byteSize();
+		case BvhLayout::Compressed8:
+			return compressedBvh8.byteSize();
+		default:
+			return bvh.byteSize();
+	}
 }
 
 void TriangleMesh::scaleTranslate(double scale, const Vector& translation) {
 	for (Vector& vertex: vertices) {
 		vertex = vertex * scale + translation;
 	}
+	refitBvh();
 }
 
 void TriangleMesh::rotate(double angleRad, uint32_t axis) {
 	for (Vector& vertex: vertices) {
 		vertex.rotate(angleRad, axis);
 	}
+	refitBvh();
 }
 
-Object::IntersectResult TriangleMesh::intersect(const Ray& ray) const {
-	if (!rootBvh->boundingBox.intersect(ray).result) { return {}; }
-	std::stack<const BoundingVolumeHierarchy*> stack;
-	IntersectResult bestIntersect {.impact = {}, .normal = {}, .distance = std::numeric_limits<double>::infinity(), .albedo = {}};
-	stack.push(rootBvh);
-	BoundingBox::IntersectResult intersect;
-	while (!stack.empty()) {
-		const BoundingVolumeHierarchy* bvh = stack.top();
-		stack.pop();
-		if (bvh->leftChild != nullptr) {
-			if (intersect = bvh->leftChild->boundingBox.intersect(ray); intersect.result && intersect.distance < bestIntersect.distance) { stack.push(bvh->leftChild); }
-			if (intersect = bvh->rightChild->boundingBox.intersect(ray); intersect.result && intersect.distance < bestIntersect.distance) { stack.push(bvh->rightChild); }
-		} else {
-			IntersectResult result = bvh->intersect(ray);
-			if (result.distance < bestIntersect.distance) { bestIntersect = result; }
-		}
+BoundingBox TriangleMesh::boundingBox() const {
+	BoundingBox box;
+	for (const Vector& vertex: vertices) { box.grow(vertex); }
+	return box;
+}
+
+template<typename LeafFunction>
+void TriangleMesh::traverse(const Ray& ray, const double& tMax, LeafFunction&& leaf) const {
+	switch (bvhLayout) {
+		case BvhLayout::Wide4:
+			bvh4.traverse(ray, tMax, leaf);
+			break;
+		case BvhLayout::Wide8:
+			bvh8.traverse(ray, tMax, leaf);
+			break;
+		case BvhLayout::Compressed4:
+			compressedBvh4.traverse(ray, tMax, leaf);
+			break;
+		case BvhLayout::Compressed8:
+			compressedBvh8.traverse(ray, tMax, leaf);
+			break;
+		default:
+			bvh.traverse(ray, tMax, leaf);
+	}
+}
+
+template<typename LeafFunction>
+void TriangleMesh::traverse(const RayPacket& packet, uint32_t mask, LeafFunction&& leaf) const {
+	switch (bvhLayout) {
+		case BvhLayout::Wide4:
+			bvh4.traverse(packet, mask, leaf);
+			break;
+		case BvhLayout::Wide8:
+			bvh8.traverse(packet, mask, leaf);
+			break;
+		case BvhLayout::Compressed4:
+			compressedBvh4.traverse(packet, mask, leaf);
+			break;
+		case BvhLayout::Compressed8:
+			compressedBvh8.traverse(packet, mask, leaf);
+			break;
+		default:
+			bvh.traverse(packet, mask, leaf);
 	}
-	return bestIntersect;
+}
+
+Object::Hit TriangleMesh::closestHit(const Ray& ray, double tMax) const {
+	Hit best {.distance = tMax, .primitive = 0, .beta = 0, .gamma = 0, .result = false};
+	traverse(ray, best.distance, [this, &ray, &best](uint32_t start, uint32_t end) {
+		Hit hit = intersectTriangles(ray, start, end, best.distance);
+		if (hit.result && hit.distance < best.distance) { best = hit; }
+		return false;
+	});
+	return best;
+}
+
+uint32_t TriangleMesh::closestHits(RayPacket& packet, uint32_t mask, std::array<Hit, RayPacket::MAX_SIZE>& hits) const {
+	uint32_t improved = 0;
+	traverse(packet, mask, [this, &packet, &hits, &improved](uint32_t start, uint32_t end, uint32_t laneMask) {
+		for (; laneMask != 0; laneMask &= laneMask - 1) {
+			auto lane = static_cast<uint32_t>(std::countr_zero(laneMask));
+			Hit hit = intersectTriangles(packet.ray(lane), start, end, hits[lane].distance);
+			if (!hit.result || hit.distance >= hits[lane].distance) { continue; }
+			hits[lane] = hit;
+			packet.setDistance(lane, hit.distance);
+			improved |= 1u << lane;
+		}
+		return false;
+	});
+	return improved;
+}
+
+bool TriangleMesh::occluded(const Ray& ray, double tMax) const {
+	bool hit = false;
+	traverse(ray, tMax, [this, &ray, tMax, &hit](uint32_t start, uint32_t end) {
+		hit = occludedTriangles(ray, start, end, tMax);
+		return hit;
+	});
+	return hit;
 }
@@ -9,56 +9,29 @@
 #include <vector>
 #include <cstdint>
 #include <climits>
+#include <string>
 
+#include "BoundingVolumeHierarchy.h"
 #include "Object.h"
+#include "TrianglePacket.h"
 #include "Vector.h"
+#include "WideBoundingVolumeHierarchy.h"
 
-class TriangleMesh;
-
+// What building and packing read from a triangle
 class TriangleIndices {
 public:
 	explicit TriangleIndices() = default;
 
 	std::array<uint32_t, 3> vertexIndices {};
-	std::array<uint32_t, 3> colorIndices {};
-	std::array<uint32_t, 3> normalIndices {};
-	Vector barycenter;
-
-	uint32_t group = UINT_MAX;       // face group
 };
 
-class BoundingBox {
-public:
-	struct IntersectResult {
-		double distance = 0;
-		bool result = false;
-	};
-
-	[[nodiscard]] IntersectResult intersect(const Ray&) const;
-	[[nodiscard]] Vector extent() const;
-
-	Vector min;
-	Vector max;
-};
-
-
-class BoundingVolumeHierarchy {
-public:
-	BoundingVolumeHierarchy(uint32_t start, uint32_t end, const TriangleMesh& mesh);
-	~BoundingVolumeHierarchy();
-
-	void buildBoundingBox();
-	[[nodiscard]] Object::IntersectResult intersect(const Ray& ray) const;
-
-	const BoundingVolumeHierarchy* leftChild = nullptr;
-	const BoundingVolumeHierarchy* rightChild = nullptr;
-	BoundingBox boundingBox;
-	uint32_t rangeStart;
-	uint32_t rangeEnd;
-	const TriangleMesh& mesh;
+// Shading attributes of a triangle, only read for the closest hit
+struct TriangleAttributes {
+	std::array<uint32_t, 3> colorIndices {};
+	std::array<uint32_t, 3> normalIndices {};
+	uint32_t group = UINT_MAX; // face group
 };
 
-
 class TriangleMesh: public Object {
 public:
 	struct Texture {
@@ -68,26 +41,74 @@ public:
 	};
 
 	explicit TriangleMesh(const Vector& albedo);
-	~TriangleMesh() override;
 
 	void readOBJ(const char* obj);
 	void loadTexture(const char* fileName);
-	void computeTriangleBarycenters();
-	void buildBvh();
+	// Returns true when the tree was loaded from bvhCacheFile rather than built
+	bool buildBvh(const BvhBuildOptions& options = {});
+	// Updates the BVH bounds after the vertices moved, returns true if the tree got too loose and was rebuilt instead
+	bool refitBvh();
 	void scaleTranslate(double scale, const Vector& translation);
 	void rotate(double angleRad, uint32_t axis);
-	[[nodiscard]] IntersectResult intersect(const Ray& ray) const override;
+	[[nodiscard]] Hit closestHit(const Ray& ray, double tMax) const override;
+	[[nodiscard]] IntersectResult hitAttributes(const Ray& ray, const Hit& hit) const override;
+	// Traces the lanes together through the tree of bvhLayout
+	uint32_t closestHits(RayPacket& packet, uint32_t mask, std::array<Hit, RayPacket::MAX_SIZE>& hits) const override;
+	[[nodiscard]] bool occluded(const Ray& ray, double tMax) const override;
+	[[nodiscard]] BoundingBox boundingBox() const override;
+	[[nodiscard]] size_t bvhNodeCount() const;
+	[[nodiscard]] size_t bvhByteSize() const;
+	// Triangles with their attributes, sources and packets, without the shared vertex data
+	[[nodiscard]] size_t triangleByteSize() const;
 
 	std::vector<TriangleIndices> triangles;
+	std::vector<TriangleAttributes> triangleAttributes; // same order as triangles
 	std::vector<Vector> vertices;
 	std::vector<Vector> normals;
 	std::vector<Vector> uvs;
 	std::vector<Vector> vertexColors;
 	std::vector<Texture> textures;
-	BoundingVolumeHierarchy* rootBvh = nullptr;
+	BoundingVolumeHierarchy bvh;
+	WideBoundingVolumeHierarchy<4> bvh4;
+	WideBoundingVolumeHierarchy<8> bvh8;
+	WideBoundingVolumeHierarchy<4, CompressedWideBvhNode<4>> compressedBvh4;
+	WideBoundingVolumeHierarchy<8, CompressedWideBvhNode<8>> compressedBvh8;
+	std::vector<uint32_t> triangleSources; // index in the OBJ file of each triangle, which spatial splits may duplicate
+	// Leaf triangles in packets, in leaf order, updated with the BVH. Only the packets of the current precision are filled.
+	std::vector<TrianglePacket<double>> trianglePackets;
+	std::vector<TrianglePacket<float>> floatTrianglePackets;
+	// Lane of each triangle, counted over all the packets (packet * WIDTH + lane). The triangles of a leaf take consecutive lanes,
+	// so that the part of a leaf a split wide BVH leaf refers to is a range of lanes too.
+	std::vector<uint32_t> triangleLanes;
+	GeometryPrecision precision = GeometryPrecision::Double; // taken into account by the next BVH build
+	BvhBuildOptions bvhOptions;
+	BvhLayout bvhLayout = BvhLayout::Binary; // options.layout of the last build
+	std::string bvhCacheFile; // set next to the OBJ by readOBJ, no cache when empty
 
 private:
-	void buildBvh(BoundingVolumeHierarchy* bvh);
+	[[nodiscard]] std::vector<BoundingBox> computeTriangleBounds() const;
+	[[nodiscard]] std::vector<Vector> computeTriangleCentroids() const;
+	// Moves the triangle at order[index] to index in every per-triangle array, order may repeat triangles
+	void gatherTriangles(const std::vector<uint32_t>& order);
+	[[nodiscard]] BoundingBox clipTriangle(uint32_t index, uint32_t axis, double min, double max) const;
+	void restoreSourceTriangles();
+	void buildBinaryBvh();
+	[[nodiscard]] uint64_t bvhCacheKey() const;
+	bool loadBvhCache(uint64_t key);
+	void saveBvhCache(uint64_t key) const;
+	void collapseBvh();
+	void applyPrimitiveOrder(const std::vector<uint32_t>& primitiveOrder);
+	void computeTrianglePackets();
+	template<typename Real>
+	void packLeaves(const std::vector<std::pair<uint32_t, uint32_t>>& leaves, std::vector<TrianglePacket<Real>>& packets);
+	template<typename LeafFunction>
+	void traverse(const Ray& ray, const double& tMax, LeafFunction&& leaf) const;
+	template<typename LeafFunction>
+	void traverse(const RayPacket& packet, uint32_t mask, LeafFunction&& leaf) const;
+	// Closest hit up to tMax (included) among the triangles start to end of a leaf
+	[[nodiscard]] Hit intersectTriangles(const Ray& ray, uint32_t start, uint32_t end, double tMax) const;
+	[[nodiscard]] bool occludedTriangles(const Ray& ray, uint32_t start, uint32_t end, double tMax) const;
+	[[nodiscard]] Hit refineHit(const Ray& ray, const Hit& hit) const;
 };
 
 #endif //TRIANGLEMESH_H
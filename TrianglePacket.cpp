@@ -0,0 +1,261 @@
+//
+// Created by remi on 18/10/26.
+//
+
+#include "TrianglePacket.h"
+
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+bool intersectTriangle(const Ray& ray, const Vector& v0, const Vector& e1, const Vector& e2, const Vector& normal, double& t, double& beta, double& gamma) {
+	Vector ao = ray.origin - v0;
+	Vector aoCrossU = ao.cross(ray.direction);
+	double invDet = 1. / ray.direction.dot(normal);
+	beta = -e2.dot(aoCrossU) * invDet;
+	if (beta < 0 || beta > 1) { return false; }
+	gamma = e1.dot(aoCrossU) * invDet;
+	if (gamma < 0 || gamma > 1) { return false; }
+	if (1 - beta - gamma < 0) { return false; }
+	t = -ao.dot(normal) * invDet;
+	return t >= 0;
+}
+
+void intersectTrianglePlane(const Ray& ray, const Vector& v0, const Vector& e1, const Vector& e2, const Vector& normal, double& t, double& beta, double& gamma) {
+	Vector ao = ray.origin - v0;
+	Vector aoCrossU = ao.cross(ray.direction);
+	double invDet = 1. / ray.direction.dot(normal);
+	beta = -e2.dot(aoCrossU) * invDet;
+	gamma = e1.dot(aoCrossU) * invDet;
+	t = -ao.dot(normal) * invDet;
+}
+
+template<typename Real>
+void TrianglePacket<Real>::set(uint32_t lane, uint32_t triangle, const Vector& a, const Vector& b, const Vector& c) {
+	Vector edge1 = b - a;
+	Vector edge2 = c - a;
+	Vector n = edge1.cross(edge2);
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		v0[axis][lane] = static_cast<Real>(a[axis]);
+		e1[axis][lane] = static_cast<Real>(edge1[axis]);
+		e2[axis][lane] = static_cast<Real>(edge2[axis]);
+		normal[axis][lane] = static_cast<Real>(n[axis]);
+	}
+	index[lane] = triangle;
+	laneMask |= 1u << lane;
+}
+
+// Operations are done in the same order as with Vector, so that every path gives the same bits.
+// Comparisons are ordered: NaN values coming from degenerate triangles are misses.
+#if defined(__AVX__)
+static __m256d dot(const __m256d* a, const __m256d* b) {
+	return _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(a[0], b[0]), _mm256_mul_pd(a[1], b[1])), _mm256_mul_pd(a[2], b[2]));
+}
+
+template<>
+uint32_t TrianglePacket<double>::intersect(const Ray& ray, double tMax, std::array<double, WIDTH>& t, std::array<double, WIDTH>& beta, std::array<double, WIDTH>& gamma) const {
+	__m256d direction[3], ao[3], n[3], edge1[3], edge2[3];
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		direction[axis] = _mm256_set1_pd(ray.direction[axis]);
+		ao[axis] = _mm256_sub_pd(_mm256_set1_pd(ray.origin[axis]), _mm256_load_pd(v0[axis].data()));
+		n[axis] = _mm256_load_pd(normal[axis].data());
+		edge1[axis] = _mm256_load_pd(e1[axis].data());
+		edge2[axis] = _mm256_load_pd(e2[axis].data());
+	}
+	__m256d aoCrossU[3] = {
+		_mm256_sub_pd(_mm256_mul_pd(ao[1], direction[2]), _mm256_mul_pd(ao[2], direction[1])),
+		_mm256_sub_pd(_mm256_mul_pd(ao[2], direction[0]), _mm256_mul_pd(ao[0], direction[2])),
+		_mm256_sub_pd(_mm256_mul_pd(ao[0], direction[1]), _mm256_mul_pd(ao[1], direction[0]))
+	};
+	__m256d signMask = _mm256_set1_pd(-0.);
+	__m256d zero = _mm256_setzero_pd();
+	__m256d one = _mm256_set1_pd(1);
+	__m256d invDet = _mm256_div_pd(one, dot(n, direction));
+	__m256d betas = _mm256_mul_pd(_mm256_xor_pd(dot(aoCrossU, edge2), signMask), invDet);
+	__m256d gammas = _mm256_mul_pd(dot(aoCrossU, edge1), invDet);
+	__m256d distances = _mm256_mul_pd(_mm256_xor_pd(dot(n, ao), signMask), invDet);
+	__m256d hit = _mm256_and_pd(_mm256_cmp_pd(betas, zero, _CMP_GE_OQ), _mm256_cmp_pd(betas, one, _CMP_LE_OQ));
+	hit = _mm256_and_pd(hit, _mm256_and_pd(_mm256_cmp_pd(gammas, zero, _CMP_GE_OQ), _mm256_cmp_pd(gammas, one, _CMP_LE_OQ)));
+	hit = _mm256_and_pd(hit, _mm256_cmp_pd(_mm256_sub_pd(_mm256_sub_pd(one, betas), gammas), zero, _CMP_GE_OQ));
+	hit = _mm256_and_pd(hit, _mm256_and_pd(_mm256_cmp_pd(distances, zero, _CMP_GE_OQ), _mm256_cmp_pd(distances, _mm256_set1_pd(tMax), _CMP_LE_OQ)));
+	_mm256_storeu_pd(t.data(), distances);
+	_mm256_storeu_pd(beta.data(), betas);
+	_mm256_storeu_pd(gamma.data(), gammas);
+	return static_cast<uint32_t>(_mm256_movemask_pd(hit)) & laneMask;
+}
+#elif defined(__SSE2__)
+static __m128d dot(const __m128d* a, const __m128d* b) {
+	return _mm_add_pd(_mm_add_pd(_mm_mul_pd(a[0], b[0]), _mm_mul_pd(a[1], b[1])), _mm_mul_pd(a[2], b[2]));
+}
+
+// Two lanes at a time
+template<>
+uint32_t TrianglePacket<double>::intersect(const Ray& ray, double tMax, std::array<double, WIDTH>& t, std::array<double, WIDTH>& beta, std::array<double, WIDTH>& gamma) const {
+	__m128d signMask = _mm_set1_pd(-0.);
+	__m128d zero = _mm_setzero_pd();
+	__m128d one = _mm_set1_pd(1);
+	__m128d maxDistance = _mm_set1_pd(tMax);
+	uint32_t mask = 0;
+	for (uint32_t lane = 0; lane < WIDTH; lane += 2) {
+		__m128d direction[3], ao[3], n[3], edge1[3], edge2[3];
+		for (uint32_t axis = 0; axis < 3; axis++) {
+			direction[axis] = _mm_set1_pd(ray.direction[axis]);
+			ao[axis] = _mm_sub_pd(_mm_set1_pd(ray.origin[axis]), _mm_load_pd(v0[axis].data() + lane));
+			n[axis] = _mm_load_pd(normal[axis].data() + lane);
+			edge1[axis] = _mm_load_pd(e1[axis].data() + lane);
+			edge2[axis] = _mm_load_pd(e2[axis].data() + lane);
+		}
+		__m128d aoCrossU[3] = {
+			_mm_sub_pd(_mm_mul_pd(ao[1], direction[2]), _mm_mul_pd(ao[2], direction[1])),
+			_mm_sub_pd(_mm_mul_pd(ao[2], direction[0]), _mm_mul_pd(ao[0], direction[2])),
+			_mm_sub_pd(_mm_mul_pd(ao[0], direction[1]), _mm_mul_pd(ao[1], direction[0]))
+		};
+		__m128d invDet = _mm_div_pd(one, dot(n, direction));
+		__m128d betas = _mm_mul_pd(_mm_xor_pd(dot(aoCrossU, edge2), signMask), invDet);
+		__m128d gammas = _mm_mul_pd(dot(aoCrossU, edge1), invDet);
+		__m128d distances = _mm_mul_pd(_mm_xor_pd(dot(n, ao), signMask), invDet);
+		__m128d hit = _mm_and_pd(_mm_cmpge_pd(betas, zero), _mm_cmple_pd(betas, one));
+		hit = _mm_and_pd(hit, _mm_and_pd(_mm_cmpge_pd(gammas, zero), _mm_cmple_pd(gammas, one)));
+		hit = _mm_and_pd(hit, _mm_cmpge_pd(_mm_sub_pd(_mm_sub_pd(one, betas), gammas), zero));
+		hit = _mm_and_pd(hit, _mm_and_pd(_mm_cmpge_pd(distances, zero), _mm_cmple_pd(distances, maxDistance)));
+		_mm_storeu_pd(t.data() + lane, distances);
+		_mm_storeu_pd(beta.data() + lane, betas);
+		_mm_storeu_pd(gamma.data() + lane, gammas);
+		mask |= static_cast<uint32_t>(_mm_movemask_pd(hit)) << lane;
+	}
+	return mask & laneMask;
+}
+#else
+template<>
+uint32_t TrianglePacket<double>::intersect(const Ray& ray, double tMax, std::array<double, WIDTH>& t, std::array<double, WIDTH>& beta, std::array<double, WIDTH>& gamma) const {
+	uint32_t mask = 0;
+	for (uint32_t lane = 0; lane < WIDTH; lane++) {
+		bool hit = intersectTriangle(ray, Vector(v0[0][lane], v0[1][lane], v0[2][lane]), Vector(e1[0][lane], e1[1][lane], e1[2][lane]),
+		                             Vector(e2[0][lane], e2[1][lane], e2[2][lane]), Vector(normal[0][lane], normal[1][lane], normal[2][lane]), t[lane], beta[lane], gamma[lane]);
+		mask |= static_cast<uint32_t>(hit && t[lane] <= tMax) << lane;
+	}
+	return mask & laneMask;
+}
+#endif
+
+// Single precision hits: the rounding of the distance grows with the coordinates of the ray origin and of the triangle,
+// hits closer than DISTANCE_TOLERANCE times their size are taken for the surface the ray leaves.
+static float originMagnitude(const Ray& ray) {
+	return std::abs(static_cast<float>(ray.origin[0])) + std::abs(static_cast<float>(ray.origin[1])) + std::abs(static_cast<float>(ray.origin[2]));
+}
+
+#if defined(__AVX__)
+static __m256 dot(const __m256* a, const __m256* b) {
+	return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a[0], b[0]), _mm256_mul_ps(a[1], b[1])), _mm256_mul_ps(a[2], b[2]));
+}
+
+template<>
+uint32_t TrianglePacket<float>::intersect(const Ray& ray, double tMax, std::array<float, WIDTH>& t, std::array<float, WIDTH>& beta, std::array<float, WIDTH>& gamma) const {
+	__m256 direction[3], ao[3], n[3], edge1[3], edge2[3];
+	__m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	__m256 originOffset = _mm256_setzero_ps();
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		direction[axis] = _mm256_set1_ps(static_cast<float>(ray.direction[axis]));
+		ao[axis] = _mm256_sub_ps(_mm256_set1_ps(static_cast<float>(ray.origin[axis])), _mm256_load_ps(v0[axis].data()));
+		originOffset = _mm256_add_ps(originOffset, _mm256_and_ps(ao[axis], absMask));
+		n[axis] = _mm256_load_ps(normal[axis].data());
+		edge1[axis] = _mm256_load_ps(e1[axis].data());
+		edge2[axis] = _mm256_load_ps(e2[axis].data());
+	}
+	__m256 aoCrossU[3] = {
+		_mm256_sub_ps(_mm256_mul_ps(ao[1], direction[2]), _mm256_mul_ps(ao[2], direction[1])),
+		_mm256_sub_ps(_mm256_mul_ps(ao[2], direction[0]), _mm256_mul_ps(ao[0], direction[2])),
+		_mm256_sub_ps(_mm256_mul_ps(ao[0], direction[1]), _mm256_mul_ps(ao[1], direction[0]))
+	};
+	__m256 signMask = _mm256_set1_ps(-0.f);
+	__m256 one = _mm256_set1_ps(1);
+	__m256 lower = _mm256_set1_ps(-EDGE_TOLERANCE);
+	__m256 upper = _mm256_set1_ps(1 + EDGE_TOLERANCE);
+	__m256 minDistance = _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(originMagnitude(ray)), originOffset), _mm256_set1_ps(DISTANCE_TOLERANCE));
+	__m256 invDet = _mm256_div_ps(one, dot(n, direction));
+	__m256 betas = _mm256_mul_ps(_mm256_xor_ps(dot(aoCrossU, edge2), signMask), invDet);
+	__m256 gammas = _mm256_mul_ps(dot(aoCrossU, edge1), invDet);
+	__m256 distances = _mm256_mul_ps(_mm256_xor_ps(dot(n, ao), signMask), invDet);
+	__m256 hit = _mm256_and_ps(_mm256_cmp_ps(betas, lower, _CMP_GE_OQ), _mm256_cmp_ps(betas, upper, _CMP_LE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(gammas, lower, _CMP_GE_OQ), _mm256_cmp_ps(gammas, upper, _CMP_LE_OQ)));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_sub_ps(_mm256_sub_ps(one, betas), gammas), lower, _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(distances, minDistance, _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(distances, _mm256_set1_ps(static_cast<float>(tMax)), _CMP_LE_OQ));
+	_mm256_storeu_ps(t.data(), distances);
+	_mm256_storeu_ps(beta.data(), betas);
+	_mm256_storeu_ps(gamma.data(), gammas);
+	return static_cast<uint32_t>(_mm256_movemask_ps(hit)) & laneMask;
+}
+#elif defined(__SSE2__)
+static __m128 dot(const __m128* a, const __m128* b) {
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+}
+
+template<>
+uint32_t TrianglePacket<float>::intersect(const Ray& ray, double tMax, std::array<float, WIDTH>& t, std::array<float, WIDTH>& beta, std::array<float, WIDTH>& gamma) const {
+	__m128 direction[3], ao[3], n[3], edge1[3], edge2[3];
+	__m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 originOffset = _mm_setzero_ps();
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		direction[axis] = _mm_set1_ps(static_cast<float>(ray.direction[axis]));
+		ao[axis] = _mm_sub_ps(_mm_set1_ps(static_cast<float>(ray.origin[axis])), _mm_load_ps(v0[axis].data()));
+		originOffset = _mm_add_ps(originOffset, _mm_and_ps(ao[axis], absMask));
+		n[axis] = _mm_load_ps(normal[axis].data());
+		edge1[axis] = _mm_load_ps(e1[axis].data());
+		edge2[axis] = _mm_load_ps(e2[axis].data());
+	}
+	__m128 aoCrossU[3] = {
+		_mm_sub_ps(_mm_mul_ps(ao[1], direction[2]), _mm_mul_ps(ao[2], direction[1])),
+		_mm_sub_ps(_mm_mul_ps(ao[2], direction[0]), _mm_mul_ps(ao[0], direction[2])),
+		_mm_sub_ps(_mm_mul_ps(ao[0], direction[1]), _mm_mul_ps(ao[1], direction[0]))
+	};
+	__m128 signMask = _mm_set1_ps(-0.f);
+	__m128 one = _mm_set1_ps(1);
+	__m128 lower = _mm_set1_ps(-EDGE_TOLERANCE);
+	__m128 upper = _mm_set1_ps(1 + EDGE_TOLERANCE);
+	__m128 minDistance = _mm_mul_ps(_mm_add_ps(_mm_set1_ps(originMagnitude(ray)), originOffset), _mm_set1_ps(DISTANCE_TOLERANCE));
+	__m128 invDet = _mm_div_ps(one, dot(n, direction));
+	__m128 betas = _mm_mul_ps(_mm_xor_ps(dot(aoCrossU, edge2), signMask), invDet);
+	__m128 gammas = _mm_mul_ps(dot(aoCrossU, edge1), invDet);
+	__m128 distances = _mm_mul_ps(_mm_xor_ps(dot(n, ao), signMask), invDet);
+	__m128 hit = _mm_and_ps(_mm_cmpge_ps(betas, lower), _mm_cmple_ps(betas, upper));
+	hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(gammas, lower), _mm_cmple_ps(gammas, upper)));
+	hit = _mm_and_ps(hit, _mm_cmpge_ps(_mm_sub_ps(_mm_sub_ps(one, betas), gammas), lower));
+	hit = _mm_and_ps(hit, _mm_cmpge_ps(distances, minDistance));
+	hit = _mm_and_ps(hit, _mm_cmple_ps(distances, _mm_set1_ps(static_cast<float>(tMax))));
+	_mm_storeu_ps(t.data(), distances);
+	_mm_storeu_ps(beta.data(), betas);
+	_mm_storeu_ps(gamma.data(), gammas);
+	return static_cast<uint32_t>(_mm_movemask_ps(hit)) & laneMask;
+}
+#else
+template<>
+uint32_t TrianglePacket<float>::intersect(const Ray& ray, double tMax, std::array<float, WIDTH>& t, std::array<float, WIDTH>& beta, std::array<float, WIDTH>& gamma) const {
+	float magnitude = originMagnitude(ray);
+	uint32_t mask = 0;
+	for (uint32_t lane = 0; lane < WIDTH; lane++) {
+		std::array<float, 3> direction {}, ao {};
+		float originOffset = 0;
+		for (uint32_t axis = 0; axis < 3; axis++) {
+			direction[axis] = static_cast<float>(ray.direction[axis]);
+			ao[axis] = static_cast<float>(ray.origin[axis]) - v0[axis][lane];
+			originOffset += std::abs(ao[axis]);
+		}
+		std::array<float, 3> aoCrossU {ao[1] * direction[2] - ao[2] * direction[1], ao[2] * direction[0] - ao[0] * direction[2], ao[0] * direction[1] - ao[1] * direction[0]};
+		float invDet = 1 / (normal[0][lane] * direction[0] + normal[1][lane] * direction[1] + normal[2][lane] * direction[2]);
+		beta[lane] = -(aoCrossU[0] * e2[0][lane] + aoCrossU[1] * e2[1][lane] + aoCrossU[2] * e2[2][lane]) * invDet;
+		gamma[lane] = (aoCrossU[0] * e1[0][lane] + aoCrossU[1] * e1[1][lane] + aoCrossU[2] * e1[2][lane]) * invDet;
+		t[lane] = -(normal[0][lane] * ao[0] + normal[1][lane] * ao[1] + normal[2][lane] * ao[2]) * invDet;
+		float minDistance = (magnitude + originOffset) * DISTANCE_TOLERANCE;
+		bool hit = beta[lane] >= -EDGE_TOLERANCE && beta[lane] <= 1 + EDGE_TOLERANCE && gamma[lane] >= -EDGE_TOLERANCE && gamma[lane] <= 1 + EDGE_TOLERANCE &&
+		           1 - beta[lane] - gamma[lane] >= -EDGE_TOLERANCE && t[lane] >= minDistance && t[lane] <= static_cast<float>(tMax);
+		mask |= static_cast<uint32_t>(hit) << lane;
+	}
+	return mask & laneMask;
+}
+#endif
+
+template struct TrianglePacket<double>;
+template struct TrianglePacket<float>;
@@ -0,0 +1,62 @@
+//
+// Created by remi on 18/10/26.
+//
+
+#ifndef TRIANGLEPACKET_H
+#define TRIANGLEPACKET_H
+
+#include <array>
+#include <cstdint>
+#include <type_traits>
+
+#include "Ray.h"
+#include "Vector.h"
+
+// Precision of the triangle tests, shading and accumulation always stay in double precision
+enum class GeometryPrecision {
+	Double,
+	Float, // packets tested in single precision with robust tolerances, only the closest hit of a ray is refined in double precision
+};
+
+// Single precision packets fill an AVX register when available, double precision ones always hold four triangles
+#if defined(__AVX__)
+constexpr uint32_t FLOAT_PACKET_WIDTH = 8;
+#else
+constexpr uint32_t FLOAT_PACKET_WIDTH = 4;
+#endif
+
+// Möller–Trumbore test of one triangle, e1 = v1 - v0, e2 = v2 - v0 and normal = e1 x e2
+[[nodiscard]] bool intersectTriangle(const Ray& ray, const Vector& v0, const Vector& e1, const Vector& e2, const Vector& normal, double& t, double& beta, double& gamma);
+// Same arithmetic without rejecting anything: distance to the plane of the triangle and barycentric coordinates of the point reached there
+void intersectTrianglePlane(const Ray& ray, const Vector& v0, const Vector& e1, const Vector& e2, const Vector& normal, double& t, double& beta, double& gamma);
+
+// Triangles of a leaf stored as structure of arrays (v0[axis][lane]), so that one Möller–Trumbore test covers all of them.
+// Packets are tested with AVX when available, SSE2 otherwise, each with a scalar fallback giving the same results.
+template<typename Real>
+struct alignas(32) TrianglePacket {
+	static constexpr uint32_t WIDTH = std::is_same_v<Real, float> ? FLOAT_PACKET_WIDTH : 4;
+	// Single precision tests accept points up to EDGE_TOLERANCE outside the edges, so that rounding leaves no crack between neighboring triangles.
+	// They only accept distances beyond DISTANCE_TOLERANCE times the size of the ray origin and of its offset to the triangle,
+	// which bounds the rounding of the distance unless the ray grazes the triangle, so that a ray leaving a surface does not hit it again.
+	static constexpr Real EDGE_TOLERANCE = 1e-4;
+	static constexpr Real DISTANCE_TOLERANCE = 1e-5;
+
+	std::array<std::array<Real, WIDTH>, 3> v0 {};
+	std::array<std::array<Real, WIDTH>, 3> e1 {};     // v1 - v0
+	std::array<std::array<Real, WIDTH>, 3> e2 {};     // v2 - v0
+	std::array<std::array<Real, WIDTH>, 3> normal {}; // e1 x e2, not normalized
+	std::array<uint32_t, WIDTH> index {};             // triangle of each lane
+	uint32_t laneMask = 0;                            // used lanes
+
+	void set(uint32_t lane, uint32_t triangle, const Vector& a, const Vector& b, const Vector& c);
+	// Returns the mask of lanes hit between the ray origin and tMax (included), with their distance and barycentric coordinates.
+	// Double precision results are exact, single precision ones are within the tolerances above.
+	uint32_t intersect(const Ray& ray, double tMax, std::array<Real, WIDTH>& t, std::array<Real, WIDTH>& beta, std::array<Real, WIDTH>& gamma) const;
+};
+
+template<>
+uint32_t TrianglePacket<double>::intersect(const Ray& ray, double tMax, std::array<double, WIDTH>& t, std::array<double, WIDTH>& beta, std::array<double, WIDTH>& gamma) const;
+template<>
+uint32_t TrianglePacket<float>::intersect(const Ray& ray, double tMax, std::array<float, WIDTH>& t, std::array<float, WIDTH>& beta, std::array<float, WIDTH>& gamma) const;
+
+#endif //TRIANGLEPACKET_H
@@ -0,0 +1,391 @@
+//
+// Created by remi on 18/10/26.
+//
+
+#include "WideBoundingVolumeHierarchy.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <limits>
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+// The breadth-first top of the tree fills one page
+constexpr size_t BREADTH_FIRST_TOP_BYTES = 4096;
+
+typedef std::array<const float*, 3> Planes;
+
+PrecomputedRay::PrecomputedRay(const Ray& ray) {
+	for (uint32_t i = 0; i < 3; i++) {
+		origin[i] = static_cast<float>(ray.origin[i]);
+		inverseDirection[i] = static_cast<float>(1 / ray.direction[i]);
+		negative[i] = std::signbit(ray.direction[i]);
+	}
+}
+
+PrecomputedRay::PrecomputedRay(const RayPacket& packet, uint32_t lane) {
+	for (uint32_t i = 0; i < 3; i++) {
+		origin[i] = packet.origin[i][lane];
+		inverseDirection[i] = packet.inverseDirection[i][lane];
+		negative[i] = std::signbit(packet.directions[lane][i]);
+	}
+}
+
+// std::max and std::min return their first operand when the comparison involves NaN, so NaN distances
+// (ray origin on a plane it is parallel to) are ignored by passing the accumulator first.
+static uint32_t slabTestScalar(const Planes& near, const Planes& far, uint32_t lane, const PrecomputedRay& ray, float tMax, float* distances) {
+	float tNear = 0;
+	float tFar = tMax;
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		float t0 = (near[axis][lane] - ray.origin[axis]) * ray.inverseDirection[axis];
+		float t1 = (far[axis][lane] - ray.origin[axis]) * ray.inverseDirection[axis] * SLAB_PADDING;
+		tNear = std::max(tNear, t0);
+		tFar = std::min(tFar, t1);
+	}
+	*distances = tNear;
+	return tNear <= tFar;
+}
+
+#if defined(__SSE__)
+// The SSE min and max return their second operand when a comparison involves NaN, hence the accumulator last
+static uint32_t slabTest4(const Planes& near, const Planes& far, uint32_t lane, const PrecomputedRay& ray, float tMax, float* distances) {
+	__m128 tNear = _mm_setzero_ps();
+	__m128 tFar = _mm_set1_ps(tMax);
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		__m128 origin = _mm_set1_ps(ray.origin[axis]);
+		__m128 inverseDirection = _mm_set1_ps(ray.inverseDirection[axis]);
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near[axis] + lane), origin), inverseDirection);
+		__m128 t1 = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(far[axis] + lane), origin), inverseDirection), _mm_set1_ps(SLAB_PADDING));
+		tNear = _mm_max_ps(t0, tNear);
+		tFar = _mm_min_ps(t1, tFar);
+	}
+	_mm_storeu_ps(distances, tNear);
+	return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(tNear, tFar)));
+}
+#endif
+
+#if defined(__AVX__)
+static uint32_t slabTest8(const Planes& near, const Planes& far, uint32_t lane, const PrecomputedRay& ray, float tMax, float* distances) {
+	__m256 tNear = _mm256_setzero_ps();
+	__m256 tFar = _mm256_set1_ps(tMax);
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		__m256 origin = _mm256_set1_ps(ray.origin[axis]);
+		__m256 inverseDirection = _mm256_set1_ps(ray.inverseDirection[axis]);
+		__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near[axis] + lane), origin), inverseDirection);
+		__m256 t1 = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far[axis] + lane), origin), inverseDirection), _mm256_set1_ps(SLAB_PADDING));
+		tNear = _mm256_max_ps(t0, tNear);
+		tFar = _mm256_min_ps(t1, tFar);
+	}
+	_mm256_storeu_ps(distances, tNear);
+	return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ)));
+}
+#endif
+
+template<uint32_t Width>
+WideBvhNode<Width>::WideBvhNode() {
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		min[axis].fill(std::numeric_limits<float>::infinity());
+		max[axis].fill(-std::numeric_limits<float>::infinity());
+	}
+}
+
+// Slab test of Width boxes stored as min[axis][child] and max[axis][child]
+template<uint32_t Width>
+static uint32_t intersectChildren(const std::array<std::array<float, Width>, 3>& min, const std::array<std::array<float, Width>, 3>& max,
+                                  const PrecomputedRay& ray, float tMax, std::array<float, Width>& distances) {
+	Planes near {};
+	Planes far {};
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		near[axis] = ray.negative[axis] ? max[axis].data() : min[axis].data();
+		far[axis] = ray.negative[axis] ? min[axis].data() : max[axis].data();
+	}
+	uint32_t mask = 0;
+#if defined(__AVX__)
+	if constexpr (Width % 8 == 0) {
+		for (uint32_t lane = 0; lane < Width; lane += 8) { mask |= slabTest8(near, far, lane, ray, tMax, distances.data() + lane) << lane; }
+		return mask;
+	}
+#endif
+#if defined(__SSE__)
+	for (uint32_t lane = 0; lane < Width; lane += 4) { mask |= slabTest4(near, far, lane, ray, tMax, distances.data() + lane) << lane; }
+#else
+	for (uint32_t lane = 0; lane < Width; lane++) { mask |= slabTestScalar(near, far, lane, ray, tMax, distances.data() + lane) << lane; }
+#endif
+	return mask;
+}
+
+template<uint32_t Width>
+void WideBvhNode<Width>::setChildren(const std::array<BvhNode, Width>& children, uint32_t childCount) {
+	for (uint32_t child = 0; child < childCount; child++) {
+		for (uint32_t axis = 0; axis < 3; axis++) {
+			min[axis][child] = children[child].min[axis];
+			max[axis][child] = children[child].max[axis];
+		}
+		primitiveCount[child] = children[child].primitiveCount;
+	}
+}
+
+template<uint32_t Width>
+uint32_t WideBvhNode<Width>::intersect(const PrecomputedRay& ray, float tMax, std::array<float, Width>& distances) const {
+	return intersectChildren<Width>(min, max, ray, tMax, distances);
+}
+
+static float gridStep(int8_t exponent) {
+	return std::bit_cast<float>(static_cast<uint32_t>(exponent + 127) << 23);
+}
+
+// Decoding is exact up to the final addition: the step is a power of two and the quantized values fit in the mantissa
+static float dequantize(float origin, uint8_t quantized, float step) {
+	return origin + static_cast<float>(quantized) * step;
+}
+
+#if defined(__SSE2__)
+static __m128 dequantize4(float origin, const uint8_t* quantized, float step) {
+	int packed;
+	std::memcpy(&packed, quantized, sizeof(packed));
+	__m128i zero = _mm_setzero_si128();
+	__m128i values = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+	return _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(_mm_cvtepi32_ps(values), _mm_set1_ps(step)));
+}
+#endif
+
+template<uint32_t Width>
+void CompressedWideBvhNode<Width>::setChildren(const std::array<BvhNode, Width>& children, uint32_t childCount) {
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		float nodeMin = std::numeric_limits<float>::infinity();
+		float nodeMax = -std::numeric_limits<float>::infinity();
+		for (uint32_t child = 0; child < childCount; child++) {
+			nodeMin = std::min(nodeMin, children[child].min[axis]);
+			nodeMax = std::max(nodeMax, children[child].max[axis]);
+		}
+		origin[axis] = nodeMin;
+		int stepExponent = -126;
+		if (nodeMax > nodeMin) { std::frexp((static_cast<double>(nodeMax) - nodeMin) / UINT8_MAX, &stepExponent); }
+		stepExponent = std::clamp(stepExponent, -126, 127);
+		while (stepExponent < 127 && dequantize(nodeMin, UINT8_MAX, gridStep(static_cast<int8_t>(stepExponent))) < nodeMax) { stepExponent++; }
+		exponent[axis] = static_cast<int8_t>(stepExponent);
+		float step = gridStep(exponent[axis]);
+		for (uint32_t child = 0; child < childCount; child++) {
+			auto low = static_cast<uint8_t>(std::clamp(std::floor((static_cast<double>(children[child].min[axis]) - nodeMin) / step), 0., static_cast<double>(UINT8_MAX)));
+			auto high = static_cast<uint8_t>(std::clamp(std::ceil((static_cast<double>(children[child].max[axis]) - nodeMin) / step), 0., static_cast<double>(UINT8_MAX)));
+			while (low > 0 && dequantize(nodeMin, low, step) > children[child].min[axis]) { low--; }
+			while (high < UINT8_MAX && dequantize(nodeMin, high, step) < children[child].max[axis]) { high++; }
+			min[axis][child] = low;
+			max[axis][child] = high;
+		}
+	}
+	childMask = static_cast<uint8_t>((1u << childCount) - 1);
+	for (uint32_t child = 0; child < childCount; child++) { primitiveCount[child] = static_cast<uint16_t>(children[child].primitiveCount); }
+}
+
+template<uint32_t Width>
+uint32_t CompressedWideBvhNode<Width>::intersect(const PrecomputedRay& ray, float tMax, std::array<float, Width>& distances) const {
+	alignas(32) std::array<std::array<float, Width>, 3> decodedMin;
+	alignas(32) std::array<std::array<float, Width>, 3> decodedMax;
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		float step = gridStep(exponent[axis]);
+#if defined(__SSE2__)
+		for (uint32_t lane = 0; lane < Width; lane += 4) {
+			_mm_store_ps(decodedMin[axis].data() + lane, dequantize4(origin[axis], min[axis].data() + lane, step));
+			_mm_store_ps(decodedMax[axis].data() + lane, dequantize4(origin[axis], max[axis].data() + lane, step));
+		}
+#else
+		for (uint32_t child = 0; child < Width; child++) {
+			decodedMin[axis][child] = dequantize(origin[axis], min[axis][child], step);
+			decodedMax[axis][child] = dequantize(origin[axis], max[axis][child], step);
+		}
+#endif
+	}
+	return intersectChildren<Width>(decodedMin, decodedMax, ray, tMax, distances) & childMask;
+}
+
+template<uint32_t Width, typename Node>
+void WideBoundingVolumeHierarchy<Width, Node>::collapse(const BoundingVolumeHierarchy& bvh) {
+	nodes.clear();
+	if (!bvh.nodes.empty()) { collapseNode(bvh, 0); }
+	nodes.shrink_to_fit();
+}
+
+template<uint32_t Width, typename Node>
+size_t WideBoundingVolumeHierarchy<Width, Node>::byteSize() const {
+	return nodes.size() * sizeof(Node);
+}
+
+// Opens the interior child with the largest surface area until the node is full: the biggest boxes are the likeliest to be hit together.
+template<uint32_t Width, typename Node>
+uint32_t WideBoundingVolumeHierarchy<Width, Node>::collapseNode(const BoundingVolumeHierarchy& bvh, uint32_t binaryIndex) {
+	std::array<uint32_t, Width> children {};
+	uint32_t childCount = 0;
+	const BvhNode& binaryNode = bvh.nodes[binaryIndex];
+	if (binaryNode.isLeaf()) {
+		children[childCount++] = binaryIndex;
+	} else {
+		children[childCount++] = binaryIndex + 1;
+		children[childCount++] = binaryNode.offset;
+	}
+	while (childCount < Width) {
+		double largestArea = -1;
+		uint32_t largest = childCount;
+		for (uint32_t child = 0; child < childCount; child++) {
+			const BvhNode& node = bvh.nodes[children[child]];
+			if (node.isLeaf()) { continue; }
+			if (double area = node.bounds().surfaceArea(); area > largestArea) {
+				largestArea = area;
+				largest = child;
+			}
+		}
+		if (largest == childCount) { break; }
+		uint32_t opened = children[largest];
+		children[largest] = opened + 1;
+		children[childCount++] = bvh.nodes[opened].offset;
+	}
+	std::array<BvhNode, Width> childNodes {};
+	for (uint32_t child = 0; child < childCount; child++) { childNodes[child] = bvh.nodes[children[child]]; }
+	uint32_t nodeIndex = emplaceNode(childNodes, childCount);
+	for (uint32_t child = 0; child < childCount; child++) {
+		if (childNodes[child].primitiveCount > Node::MAX_LEAF_SIZE) {
+			uint32_t childIndex = splitLeaf(childNodes[child]);
+			nodes[nodeIndex].offset[child] = childIndex;
+		} else if (childNodes[child].isLeaf()) {
+			nodes[nodeIndex].offset[child] = childNodes[child].offset;
+		} else {
+			uint32_t childIndex = collapseNode(bvh, children[child]);
+			nodes[nodeIndex].offset[child] = childIndex;
+		}
+	}
+	return nodeIndex;
+}
+
+// Cuts the range of the leaf into at most Width consecutive pieces with the same box, splitting them again while they are too large.
+// Only compressed nodes need it, for leaves left by the Midpoint or Morton builders at MAX_BVH_DEPTH or by a large maxLeafSize.
+template<uint32_t Width, typename Node>
+uint32_t WideBoundingVolumeHierarchy<Width, Node>::splitLeaf(const BvhNode& leaf) {
+	std::array<BvhNode, Width> pieces {};
+	uint32_t pieceCount = 0;
+	uint32_t pieceSize = (leaf.primitiveCount + Width - 1) / Width;
+	for (uint32_t start = 0; start < leaf.primitiveCount; start += pieceSize) {
+		pieces[pieceCount] = leaf;
+		pieces[pieceCount].offset = leaf.offset + start;
+		pieces[pieceCount++].primitiveCount = std::min(pieceSize, leaf.primitiveCount - start);
+	}
+	uint32_t nodeIndex = emplaceNode(pieces, pieceCount);
+	for (uint32_t piece = 0; piece < pieceCount; piece++) {
+		uint32_t offset = pieces[piece].primitiveCount > Node::MAX_LEAF_SIZE ? splitLeaf(pieces[piece]) : pieces[piece].offset;
+		nodes[nodeIndex].offset[piece] = offset;
+	}
+	return nodeIndex;
+}
+
+template<uint32_t Width, typename Node>
+uint32_t WideBoundingVolumeHierarchy<Width, Node>::emplaceNode(const std::array<BvhNode, Width>& children, uint32_t childCount) {
+	std::array<BvhNode, Width> slots = children;
+	for (uint32_t child = 0; child < childCount; child++) {
+		if (slots[child].primitiveCount > Node::MAX_LEAF_SIZE) { slots[child].primitiveCount = 0; }
+	}
+	auto nodeIndex = static_cast<uint32_t>(nodes.size());
+	nodes.emplace_back();
+	nodes[nodeIndex].setChildren(slots, childCount);
+	return nodeIndex;
+}
+
+// Interior children are never the root, unused slots have offset 0
+template<uint32_t Width, typename Node>
+bool WideBoundingVolumeHierarchy<Width, Node>::isInteriorChild(const Node& node, uint32_t child) const {
+	return node.primitiveCount[child] == 0 && node.offset[child] != 0;
+}
+
+template<uint32_t Width, typename Node>
+std::vector<uint32_t> WideBoundingVolumeHierarchy<Width, Node>::reorder(BvhNodeOrder order) {
+	if (order == BvhNodeOrder::DepthFirst || nodes.empty()) { return {}; }
+	std::vector<uint32_t> sequence;
+	sequence.reserve(nodes.size());
+	if (order == BvhNodeOrder::BreadthFirstTop) {
+		std::deque<uint32_t> queue {0};
+		while (!queue.empty() && (sequence.size() + 1) * sizeof(Node) <= BREADTH_FIRST_TOP_BYTES) {
+			uint32_t nodeIndex = queue.front();
+			queue.pop_front();
+			sequence.push_back(nodeIndex);
+			for (uint32_t child = 0; child < Width; child++) {
+				if (isInteriorChild(nodes[nodeIndex], child)) { queue.push_back(nodes[nodeIndex].offset[child]); }
+			}
+		}
+		for (uint32_t nodeIndex: queue) { appendDepthFirst(sequence, nodeIndex); }
+	} else {
+		// Collapsed children always come after their parent, so heights can be computed backwards
+		std::vector<uint32_t> heights(nodes.size(), 1);
+		for (auto nodeIndex = static_cast<uint32_t>(nodes.size()); nodeIndex-- > 0;) {
+			for (uint32_t child = 0; child < Width; child++) {
+				if (isInteriorChild(nodes[nodeIndex], child)) { heights[nodeIndex] = std::max(heights[nodeIndex], heights[nodes[nodeIndex].offset[child]] + 1); }
+			}
+		}
+		appendVanEmdeBoas(sequence, 0, heights[0]);
+	}
+
+	std::vector<uint32_t> newIndices(nodes.size());
+	for (uint32_t index = 0; index < sequence.size(); index++) { newIndices[sequence[index]] = index; }
+	std::vector<Node> orderedNodes;
+	orderedNodes.reserve(nodes.size());
+	std::vector<uint32_t> primitiveOrder;
+	for (uint32_t nodeIndex: sequence) {
+		Node node = nodes[nodeIndex];
+		for (uint32_t child = 0; child < Width; child++) {
+			if (isInteriorChild(node, child)) {
+				node.offset[child] = newIndices[node.offset[child]];
+			} else if (node.primitiveCount[child] != 0) {
+				auto start = static_cast<uint32_t>(primitiveOrder.size());
+				for (uint32_t primitive = node.offset[child]; primitive < node.offset[child] + node.primitiveCount[child]; primitive++) { primitiveOrder.push_back(primitive); }
+				node.offset[child] = start;
+			}
+		}
+		orderedNodes.push_back(node);
+	}
+	nodes = std::move(orderedNodes);
+	return primitiveOrder;
+}
+
+template<uint32_t Width, typename Node>
+void WideBoundingVolumeHierarchy<Width, Node>::appendDepthFirst(std::vector<uint32_t>& sequence, uint32_t nodeIndex) const {
+	sequence.push_back(nodeIndex);
+	for (uint32_t child = 0; child < Width; child++) {
+		if (isInteriorChild(nodes[nodeIndex], child)) { appendDepthFirst(sequence, nodes[nodeIndex].offset[child]); }
+	}
+}
+
+// Appends the nodes less than height levels below nodeIndex
+template<uint32_t Width, typename Node>
+void WideBoundingVolumeHierarchy<Width, Node>::appendVanEmdeBoas(std::vector<uint32_t>& sequence, uint32_t nodeIndex, uint32_t height) const {
+	if (height == 1) {
+		sequence.push_back(nodeIndex);
+		return;
+	}
+	uint32_t topHeight = height / 2;
+	appendVanEmdeBoas(sequence, nodeIndex, topHeight);
+	std::vector<uint32_t> bottomRoots;
+	collectDescendants(bottomRoots, nodeIndex, topHeight);
+	for (uint32_t bottomRoot: bottomRoots) { appendVanEmdeBoas(sequence, bottomRoot, height - topHeight); }
+}
+
+template<uint32_t Width, typename Node>
+void WideBoundingVolumeHierarchy<Width, Node>::collectDescendants(std::vector<uint32_t>& descendants, uint32_t nodeIndex, uint32_t depth) const {
+	if (depth == 0) {
+		descendants.push_back(nodeIndex);
+		return;
+	}
+	for (uint32_t child = 0; child < Width; child++) {
+		if (isInteriorChild(nodes[nodeIndex], child)) { collectDescendants(descendants, nodes[nodeIndex].offset[child], depth - 1); }
+	}
+}
+
+template struct WideBvhNode<4>;
+template struct WideBvhNode<8>;
+template struct CompressedWideBvhNode<4>;
+template struct CompressedWideBvhNode<8>;
+template class WideBoundingVolumeHierarchy<4>;
+template class WideBoundingVolumeHierarchy<8>;
+template class WideBoundingVolumeHierarchy<4, CompressedWideBvhNode<4>>;
+template class WideBoundingVolumeHierarchy<8, CompressedWideBvhNode<8>>;
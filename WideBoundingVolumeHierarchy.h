@@ -0,0 +1,194 @@
+//
+// Created by remi on 18/10/26.
+//
+
+#ifndef WIDEBOUNDINGVOLUMEHIERARCHY_H
+#define WIDEBOUNDINGVOLUMEHIERARCHY_H
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "BoundingVolumeHierarchy.h"
+#include "Ray.h"
+#include "RayPacket.h"
+
+// Single precision copy of a ray, with the slab planes to test first for each axis.
+struct PrecomputedRay {
+	PrecomputedRay() = default;
+	explicit PrecomputedRay(const Ray& ray);
+	// Same values as from the ray of the lane, the packet already holds them in single precision
+	PrecomputedRay(const RayPacket& packet, uint32_t lane);
+
+	std::array<float, 3> origin;
+	std::array<float, 3> inverseDirection;
+	std::array<bool, 3> negative;
+};
+
+// Children bounds are stored as structure of arrays (min[axis][child]) so that one slab test covers all of them.
+// Unused slots have an empty box which never intersects.
+template<uint32_t Width>
+struct alignas(64) WideBvhNode {
+	static constexpr uint32_t MAX_LEAF_SIZE = std::numeric_limits<uint32_t>::max();
+
+	std::array<std::array<float, Width>, 3> min;
+	std::array<std::array<float, Width>, 3> max;
+	std::array<uint32_t, Width> offset {};         // node index of an interior child, first primitive of a leaf child
+	std::array<uint32_t, Width> primitiveCount {}; // 0 for interior children
+
+	WideBvhNode();
+	void setChildren(const std::array<BvhNode, Width>& children, uint32_t childCount);
+	// Returns the mask of children hit before tMax, and their entry distance.
+	uint32_t intersect(const PrecomputedRay& ray, float tMax, std::array<float, Width>& distances) const;
+};
+
+// Children bounds are quantized on 8 bits in a grid spanning the node box, whose step along each axis is a power of two.
+// Mins are rounded down and maxes up, so that the decoded boxes still enclose the children.
+template<uint32_t Width>
+struct alignas(64) CompressedWideBvhNode {
+	static constexpr uint32_t MAX_LEAF_SIZE = std::numeric_limits<uint16_t>::max();
+
+	std::array<float, 3> origin {};    // minimum corner of the node box
+	std::array<int8_t, 3> exponent {}; // grid step along each axis is 2^exponent
+	uint8_t childMask = 0;             // used slots, unused ones have no meaningful bounds
+	std::array<std::array<uint8_t, Width>, 3> min {};
+	std::array<std::array<uint8_t, Width>, 3> max {};
+	std::array<uint32_t, Width> offset {};
+	std::array<uint16_t, Width> primitiveCount {};
+
+	void setChildren(const std::array<BvhNode, Width>& children, uint32_t childCount);
+	uint32_t intersect(const PrecomputedRay& ray, float tMax, std::array<float, Width>& distances) const;
+};
+
+static_assert(sizeof(CompressedWideBvhNode<4>) == 64);
+
+
+// Collapsed version of a binary BVH, its leaves keep the primitive ranges of the binary tree.
+// Leaves larger than Node::MAX_LEAF_SIZE are split into several children sharing their box.
+template<uint32_t Width, typename Node = WideBvhNode<Width>>
+class WideBoundingVolumeHierarchy {
+public:
+	void collapse(const BoundingVolumeHierarchy& bvh);
+	// Lays the nodes out in the given order, then moves the leaf ranges so that they follow the nodes.
+	// Returns the new primitive order, giving the former index of each primitive, or nothing when it did not change.
+	[[nodiscard]] std::vector<uint32_t> reorder(BvhNodeOrder order);
+	[[nodiscard]] size_t byteSize() const;
+	// Same contracts as BoundingVolumeHierarchy::traverse
+	template<typename LeafFunction>
+	void traverse(const Ray& ray, const double& tMax, LeafFunction&& leaf) const;
+	template<typename LeafFunction>
+	void traverse(const RayPacket& packet, uint32_t mask, LeafFunction&& leaf) const;
+
+	std::vector<Node> nodes;
+
+private:
+	uint32_t collapseNode(const BoundingVolumeHierarchy& bvh, uint32_t binaryIndex);
+	uint32_t splitLeaf(const BvhNode& leaf);
+	// Adds a node over the given children, oversized leaves becoming interior children. Returns its index, the offsets are left to the caller.
+	uint32_t emplaceNode(const std::array<BvhNode, Width>& children, uint32_t childCount);
+	[[nodiscard]] bool isInteriorChild(const Node& node, uint32_t child) const;
+	void appendDepthFirst(std::vector<uint32_t>& sequence, uint32_t nodeIndex) const;
+	void appendVanEmdeBoas(std::vector<uint32_t>& sequence, uint32_t nodeIndex, uint32_t height) const;
+	void collectDescendants(std::vector<uint32_t>& descendants, uint32_t nodeIndex, uint32_t depth) const;
+};
+
+template<uint32_t Width, typename Node>
+template<typename LeafFunction>
+void WideBoundingVolumeHierarchy<Width, Node>::traverse(const Ray& ray, const double& tMax, LeafFunction&& leaf) const {
+	if (nodes.empty()) { return; }
+	struct Entry {
+		uint32_t offset;
+		uint32_t primitiveCount; // 0 for interior nodes
+		float distance;
+	};
+	PrecomputedRay precomputedRay(ray);
+	TraversalStack<Entry, MAX_BVH_DEPTH * Width> stack;
+	stack.push({0, 0, 0});
+	std::array<float, Width> distances {};
+	std::array<uint32_t, Width> order {};
+	while (!stack.empty()) {
+		Entry entry = stack.pop();
+		if (entry.distance > tMax) { continue; }
+		if (entry.primitiveCount != 0) {
+			if (leaf(entry.offset, entry.offset + entry.primitiveCount)) { return; }
+			continue;
+		}
+		const Node& node = nodes[entry.offset];
+		// Sorts the children hit by decreasing distance, so that the nearest one ends up on top of the stack
+		uint32_t hitCount = 0;
+		for (uint32_t hits = node.intersect(precomputedRay, static_cast<float>(tMax), distances); hits != 0; hits &= hits - 1) {
+			auto child = static_cast<uint32_t>(std::countr_zero(hits));
+			uint32_t position = hitCount++;
+			for (; position > 0 && distances[order[position - 1]] < distances[child]; position--) { order[position] = order[position - 1]; }
+			order[position] = child;
+		}
+		for (uint32_t i = 0; i < hitCount; i++) {
+			uint32_t child = order[i];
+			stack.push({node.offset[child], node.primitiveCount[child], distances[child]});
+		}
+	}
+}
+
+// Each lane tests the children of a node with the same slab test as a single ray, the children are then visited
+// by the lanes hitting them, nearest first according to the smallest entry distance among these lanes.
+template<uint32_t Width, typename Node>
+template<typename LeafFunction>
+void WideBoundingVolumeHierarchy<Width, Node>::traverse(const RayPacket& packet, uint32_t mask, LeafFunction&& leaf) const {
+	if (nodes.empty() || mask == 0) { return; }
+	struct Entry {
+		uint32_t offset;
+		uint32_t primitiveCount; // 0 for interior nodes
+		uint32_t mask;
+		float distance;          // smallest entry distance of the lanes
+	};
+	std::array<PrecomputedRay, RayPacket::MAX_SIZE> rays;
+	for (uint32_t lanes = mask; lanes != 0; lanes &= lanes - 1) {
+		auto lane = static_cast<uint32_t>(std::countr_zero(lanes));
+		rays[lane] = PrecomputedRay(packet, lane);
+	}
+	TraversalStack<Entry, MAX_BVH_DEPTH * Width> stack;
+	stack.push({0, 0, mask, 0});
+	std::array<float, Width> distances {};
+	std::array<uint32_t, Width> order {};
+	while (!stack.empty()) {
+		Entry entry = stack.pop();
+		// lanes may have found closer hits since the entry was pushed
+		for (uint32_t lanes = entry.mask; lanes != 0; lanes &= lanes - 1) {
+			auto lane = static_cast<uint32_t>(std::countr_zero(lanes));
+			if (entry.distance > packet.tMax[lane]) { entry.mask &= ~(1u << lane); }
+		}
+		if (entry.mask == 0) { continue; }
+		if (entry.primitiveCount != 0) {
+			if (leaf(entry.offset, entry.offset + entry.primitiveCount, entry.mask)) { return; }
+			continue;
+		}
+		const Node& node = nodes[entry.offset];
+		std::array<uint32_t, Width> childMasks {};
+		std::array<float, Width> childDistances;
+		childDistances.fill(std::numeric_limits<float>::infinity());
+		for (uint32_t lanes = entry.mask; lanes != 0; lanes &= lanes - 1) {
+			auto lane = static_cast<uint32_t>(std::countr_zero(lanes));
+			for (uint32_t hits = node.intersect(rays[lane], packet.tMax[lane], distances); hits != 0; hits &= hits - 1) {
+				auto child = static_cast<uint32_t>(std::countr_zero(hits));
+				childMasks[child] |= 1u << lane;
+				childDistances[child] = std::min(childDistances[child], distances[child]);
+			}
+		}
+		uint32_t hitCount = 0;
+		for (uint32_t child = 0; child < Width; child++) {
+			if (childMasks[child] == 0) { continue; }
+			uint32_t position = hitCount++;
+			for (; position > 0 && childDistances[order[position - 1]] < childDistances[child]; position--) { order[position] = order[position - 1]; }
+			order[position] = child;
+		}
+		for (uint32_t i = 0; i < hitCount; i++) {
+			uint32_t child = order[i];
+			stack.push({node.offset[child], node.primitiveCount[child], childMasks[child], childDistances[child]});
+		}
+	}
+}
+
+#endif //WIDEBOUNDINGVOLUMEHIERARCHY_H
@@ -1,6 +1,9 @@
 #include <vector>
+#include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <string_view>
+#include <omp.h>
 
 #include "stb_all.h"
 #include "Scene.h"
@@ -15,16 +18,15 @@ uint8_t adjustColor(double color) {
 
 constexpr auto get_clock = std::chrono::high_resolution_clock::now;
 
-void drawScene(const Scene& scene, const Camera& camera, const Config& config, uint8_t* buffer) {
+// Returns the time spent by the threads on the pixels, in ns
+long drawRecursive(const Scene& scene, const Camera& camera, const Config& config, uint8_t* buffer, ProgressBar& progressBar) {
 	using std::chrono_literals::operator ""ns;
 	long pixelTime = 0;
-	auto startTime = get_clock();
-	ProgressBar progressBar(config.height * config.width);
 #pragma omp parallel for default(none) schedule(dynamic) shared(scene, camera, config, buffer, pixelTime, progressBar)
 	for (int i = 0; i < config.height; i++) {
 		auto lineStartTime = get_clock();
 		for (int j = 0; j < config.width; j++) {
-			Vector pixel(j - static_cast<double>(config.width) / 2, -i + static_cast<double>(config.height) / 2, config.height / (2 * tan(config.alpha / 2)));
+			Vector pixel = Camera::pixelPosition(i, j, config);
 			Vector color = scene.getColor(camera, pixel, config);
 			buffer[(i * config.width + j) * 3 + 0] = adjustColor(color[0]);
 			buffer[(i * config.width + j) * 3 + 1] = adjustColor(color[1]);
@@ -33,12 +35,65 @@ void drawScene(const Scene& scene, const Camera& camera, const Config& config, u
 		}
 		pixelTime += (get_clock() - lineStartTime) / 1ns;
 	}
+	return pixelTime;
+}
+
+long drawWavefront(const Scene& scene, const Camera& camera, const Config& config, uint8_t* buffer, ProgressBar& progressBar) {
+	using std::chrono_literals::operator ""ns;
+	auto startTime = get_clock();
+	auto pixelCount = static_cast<uint32_t>(config.height * config.width);
+	uint32_t batchSize = std::max(1u, Scene::WAVEFRONT_SIZE / static_cast<uint32_t>(config.raysPerPixel));
+	std::vector<Vector> colors;
+	for (uint32_t firstPixel = 0; firstPixel < pixelCount; firstPixel += batchSize) {
+		colors.resize(std::min(batchSize, pixelCount - firstPixel));
+		scene.renderWavefront(camera, config, firstPixel, colors);
+		for (uint32_t pixel = 0; pixel < colors.size(); pixel++) {
+			buffer[(firstPixel + pixel) * 3 + 0] = adjustColor(colors[pixel][0]);
+			buffer[(firstPixel + pixel) * 3 + 1] = adjustColor(colors[pixel][1]);
+			buffer[(firstPixel + pixel) * 3 + 2] = adjustColor(colors[pixel][2]);
+			++progressBar;
+		}
+	}
+	// Every stage runs on all the threads
+	return (get_clock() - startTime) / 1ns * omp_get_max_threads();
+}
+
+void drawScene(const Scene& scene, const Camera& camera, const Config& config, uint8_t* buffer) {
+	using std::chrono_literals::operator ""ns;
+	auto startTime = get_clock();
+	ProgressBar progressBar(config.height * config.width);
+	long pixelTime = config.integrator == Integrator::Wavefront ? drawWavefront(scene, camera, config, buffer, progressBar) : drawRecursive(scene, camera, config, buffer, progressBar);
 	pixelTime /= config.height * config.width;
 	long totalTime = (get_clock() - startTime) / 1ns;
 	std::cout << std::format("\nTemps moyen pour un rayon: {:.2f}µs (Total {:.1f}s)", static_cast<double>(pixelTime) / config.raysPerPixel / 1000, static_cast<double>(totalTime) / 1e9) << std::endl;
 }
 
-int main() {
+void buildMeshBvh(const char* name, TriangleMesh& mesh, const Config& config) {
+	using std::chrono_literals::operator ""ns;
+	auto startTime = get_clock();
+	mesh.precision = config.precision;
+	bool cached = mesh.buildBvh(config.bvhOptions(name));
+	long buildTime = (get_clock() - startTime) / 1ns;
+	std::cout << std::format("BVH {}: {} triangles, {} noeuds ({:.1f} Ko), {} en {:.1f}ms sur {} threads", name, mesh.triangles.size(), mesh.bvhNodeCount(), static_cast<double>(mesh.bvhByteSize()) / 1024, cached ? "chargé depuis le cache" : "construit", static_cast<double>(buildTime) / 1e6, omp_get_max_threads()) << std::endl;
+}
+
+void printBvhStatistics(const char* name, const TriangleMesh& mesh) {
+	BvhStatistics statistics = mesh.bvh.statistics();
+	std::string leafSizes;
+	for (uint32_t size = 1; size < statistics.leafSizes.size(); size++) {
+		if (statistics.leafSizes[size] != 0) { leafSizes += std::format(" {}:{}", size, statistics.leafSizes[size]); }
+	}
+	std::cout << std::format("Statistiques BVH {}:\n", name)
+	          << std::format("  {} noeuds dont {} feuilles, profondeur max {}, moyenne {:.1f}\n", statistics.nodeCount, statistics.leafCount, statistics.maxDepth, statistics.averageLeafDepth)
+	          << std::format("  triangles par feuille (taille:nombre):{}\n", leafSizes)
+	          << std::format("  coût SAH {:.1f}, recouvrement moyen entre frères {:.1f}%\n", statistics.sahCost, 100 * statistics.siblingOverlap)
+	          << std::format("  mémoire: arbre binaire {:.1f} Ko, arbre parcouru {:.1f} Ko, triangles {:.1f} Ko ({:.1f} octets par triangle)", static_cast<double>(mesh.bvh.byteSize()) / 1024,
+	                         static_cast<double>(mesh.bvhByteSize()) / 1024, static_cast<double>(mesh.triangleByteSize()) / 1024,
+	                         static_cast<double>(mesh.triangleByteSize()) / static_cast<double>(mesh.triangles.size())) << std::endl;
+}
+
+int main(int argc, char** argv) {
+	bool bvhStatistics = std::find(argv + 1, argv + argc, std::string_view("--bvh-stats")) != argv + argc;
 	Config config {};
 	readConfig("../params.cfg", config);
 
@@ -70,7 +125,8 @@ int main() {
 	cobalion->loadTexture("../objects/Cobalion/Cobalion_Eye.png");
 	cobalion->rotate(M_PI / 3, 1);
 	cobalion->scaleTranslate(4.5, Vector(0, -20, -7));
-	cobalion->buildBvh();
+	buildMeshBvh("Cobalion", *cobalion, config);
+	if (bvhStatistics) { printBvhStatistics("Cobalion", *cobalion); }
 	scene.addMesh(cobalion);
 
 	auto* diancie = new TriangleMesh(Vector(.9, .4, .4));
@@ -84,8 +140,11 @@ int main() {
 	diancie->rotate(3 * M_PI / 2, 0);
 	diancie->rotate(7 * M_PI / 6, 1);
 	diancie->scaleTranslate(0.2, Vector(22, -15, 10));
-	diancie->buildBvh();
+	buildMeshBvh("Diancie", *diancie, config);
+	if (bvhStatistics) { printBvhStatistics("Diancie", *diancie); }
+
 	scene.addMesh(diancie);
+	scene.buildBvh();
 
 
 	auto* image = new unsigned char[config.width * config.height * 3];
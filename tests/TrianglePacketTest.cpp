@@ -0,0 +1,151 @@
+//
+// Checks that the double precision packet kernel of the build (AVX, SSE2 or scalar) gives the same bits as the one-triangle test,
+// and that the single precision kernel, on proper triangles hit away from the ray origin and from tMax and not at a grazing angle,
+// keeps every hit and only accepts points close to the triangle, at a distance close to the exact one.
+//
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "../Ray.h"
+#include "../TrianglePacket.h"
+#include "../Vector.h"
+
+struct Triangle {
+	Vector a;
+	Vector b;
+	Vector c;
+	bool degenerate = false; // no area, its hits only come from rounding
+};
+
+static std::mt19937_64 engine(42);
+
+static double uniform(double min, double max) {
+	return std::uniform_real_distribution<>(min, max)(engine);
+}
+
+static Vector randomPoint(double extent) {
+	return {uniform(-extent, extent), uniform(-extent, extent), uniform(-extent, extent)};
+}
+
+// Mostly proper triangles, with degenerate ones giving NaN or infinite determinants
+static Triangle randomTriangle() {
+	Vector a = randomPoint(10);
+	Vector b = a + randomPoint(2);
+	Vector c = a + randomPoint(2);
+	switch (std::uniform_int_distribution<>(0, 9)(engine)) {
+		case 0: // collinear
+			return {a, b, a + 2 * (b - a), true};
+		case 1: // a single point
+			return {a, a, a, true};
+		case 2: // NaN vertex
+			return {a, Vector(std::numeric_limits<double>::quiet_NaN(), b[1], b[2]), c, true};
+		case 3: // lying in an axis plane, for rays parallel to it
+			return {Vector(a[0], a[1], 0), Vector(b[0], b[1], 0), Vector(c[0], c[1], 0)};
+		default:
+			return {a, b, c};
+	}
+}
+
+// Aimed at a point of the triangle most of the time so that there are hits, sometimes parallel to an axis plane
+static Ray randomRay(const Triangle& triangle) {
+	Vector origin = randomPoint(20);
+	double beta = uniform(-.2, 1);
+	double gamma = uniform(-.2, 1 - beta);
+	Vector target = triangle.a + beta * (triangle.b - triangle.a) + gamma * (triangle.c - triangle.a);
+	switch (std::uniform_int_distribution<>(0, 7)(engine)) {
+		case 0:
+			return {origin, randomPoint(1).normalized()};
+		case 1: // in the plane z = 0
+			return {Vector(origin[0], origin[1], 0), Vector(target[0] - origin[0], target[1] - origin[1], 0).normalized()};
+		case 2: // starting on the triangle
+			return {target, randomPoint(1).normalized()};
+		default:
+			return {origin, (target - origin).normalized()};
+	}
+}
+
+// Bounds of the single precision errors for the coordinates above, well beyond the rounding of non grazing rays
+constexpr double FLOAT_MIN_DISTANCE = 1e-2;
+constexpr double FLOAT_EDGE_ERROR = 1e-3;
+constexpr double FLOAT_DISTANCE_ERROR = 1e-2;
+
+static bool sameBits(double a, double b) {
+	return std::memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+int main() {
+	constexpr uint32_t WIDTH = TrianglePacket<double>::WIDTH;
+	constexpr uint32_t FLOAT_WIDTH = TrianglePacket<float>::WIDTH;
+	constexpr uint32_t LANES = std::max(WIDTH, FLOAT_WIDTH); // double packets are chained to cover the lanes of a float one
+	uint32_t failures = 0;
+	uint32_t hitCount = 0;
+	for (uint32_t iteration = 0; iteration < 100000; iteration++) {
+		std::array<TrianglePacket<double>, LANES / WIDTH> packets;
+		TrianglePacket<float> floatPacket;
+		std::array<Triangle, LANES> triangles;
+		auto laneCount = static_cast<uint32_t>(std::uniform_int_distribution<>(1, LANES)(engine));
+		for (uint32_t lane = 0; lane < laneCount; lane++) {
+			triangles[lane] = randomTriangle();
+			packets[lane / WIDTH].set(lane % WIDTH, lane, triangles[lane].a, triangles[lane].b, triangles[lane].c);
+			floatPacket.set(lane, lane, triangles[lane].a, triangles[lane].b, triangles[lane].c);
+		}
+		Ray ray = randomRay(triangles[std::uniform_int_distribution<uint32_t>(0, laneCount - 1)(engine)]);
+		double tMax = iteration % 2 == 0 ? std::numeric_limits<double>::infinity() : uniform(0, 40);
+		std::array<double, LANES> t {}, beta {}, gamma {};
+		uint32_t hits = 0;
+		for (uint32_t index = 0; index < packets.size(); index++) {
+			std::array<double, WIDTH> packetT {}, packetBeta {}, packetGamma {};
+			hits |= packets[index].intersect(ray, tMax, packetT, packetBeta, packetGamma) << index * WIDTH;
+			std::copy(packetT.begin(), packetT.end(), t.begin() + index * WIDTH);
+			std::copy(packetBeta.begin(), packetBeta.end(), beta.begin() + index * WIDTH);
+			std::copy(packetGamma.begin(), packetGamma.end(), gamma.begin() + index * WIDTH);
+		}
+		std::array<float, FLOAT_WIDTH> floatT {}, floatBeta {}, floatGamma {};
+		uint32_t floatHits = floatPacket.intersect(ray, tMax, floatT, floatBeta, floatGamma);
+		if (hits >> laneCount != 0) {
+			std::cerr << "Iteration " << iteration << ": unused lanes hit, mask " << hits << '\n';
+			failures++;
+		}
+		for (uint32_t lane = 0; lane < laneCount; lane++) {
+			Vector e1 = triangles[lane].b - triangles[lane].a;
+			Vector e2 = triangles[lane].c - triangles[lane].a;
+			Vector normal = e1.cross(e2);
+			double expectedT, expectedBeta, expectedGamma;
+			bool expectedHit = intersectTriangle(ray, triangles[lane].a, e1, e2, normal, expectedT, expectedBeta, expectedGamma) && expectedT <= tMax;
+			bool hit = (hits >> lane & 1) != 0;
+			hitCount += expectedHit;
+			if (hit != expectedHit) {
+				std::cerr << "Iteration " << iteration << " lane " << lane << ": packet " << (hit ? "hits" : "misses") << ", single test " << (expectedHit ? "hits" : "misses") << '\n';
+				failures++;
+			} else if (hit && (!sameBits(t[lane], expectedT) || !sameBits(beta[lane], expectedBeta) || !sameBits(gamma[lane], expectedGamma))) {
+				std::cerr << "Iteration " << iteration << " lane " << lane << ": packet (" << t[lane] << ", " << beta[lane] << ", " << gamma[lane] << "), single test (" << expectedT << ", "
+				          << expectedBeta << ", " << expectedGamma << ")\n";
+				failures++;
+			}
+			bool grazing = std::abs(ray.direction.dot(normal)) < 1e-3 * std::sqrt(normal.norm2()); // barycentric coordinates are ill-conditioned in single precision
+			if (triangles[lane].degenerate || grazing) { continue; }
+			double planeT, planeBeta, planeGamma;
+			intersectTrianglePlane(ray, triangles[lane].a, e1, e2, normal, planeT, planeBeta, planeGamma);
+			bool clear = planeT > FLOAT_MIN_DISTANCE && planeT < tMax - FLOAT_MIN_DISTANCE;
+			bool floatHit = (floatHits >> lane & 1) != 0;
+			if (expectedHit && clear && !floatHit) {
+				std::cerr << "Iteration " << iteration << " lane " << lane << ": hit at " << expectedT << " lost by the single precision test\n";
+				failures++;
+			} else if (floatHit && (std::min({planeBeta, planeGamma, 1 - planeBeta - planeGamma}) < -FLOAT_EDGE_ERROR || std::abs(floatT[lane] - planeT) > FLOAT_DISTANCE_ERROR)) {
+				std::cerr << "Iteration " << iteration << " lane " << lane << ": single precision hit (" << floatT[lane] << ", " << floatBeta[lane] << ", " << floatGamma[lane]
+				          << "), plane of the triangle reached at (" << planeT << ", " << planeBeta << ", " << planeGamma << ")\n";
+				failures++;
+			}
+		}
+	}
+	std::cout << hitCount << " hits compared, " << failures << " failures\n";
+	return failures == 0 ? 0 : 1;
+}